@@ -60,14 +60,54 @@
 #define first   _sys_flags._flags._first        // alias for avg preload flag
 #define BTN1    _sys_flags._flags._BTN1         // alias for system Button 1 state
 #define BTN2    _sys_flags._flags._BTN2         // alias for system Button 2 state
+#define reject  _sys_flags._flags._reject       // alias for pads rejected by arbitration
 
 
 BYTE    CS_statevar;        // state variable for cap touch system
 WORD    raw[2];             // raw value variables for cap touch
 WORD    avg[2];             // current state of environment
+signed int	delta[2];		// baseline minus raw, positive when touched
 signed int	thold[2];			// thresholds
 WORD	avgrst[2];			// Average Reset counter (If key held for too long)
 WORD    temp_avg;           // temporary variable for cap touch system
+#ifdef USE_CS_ARBITRATION
+bit		cs_calibrated;		// thold comes from a calibration, not the defaults
+#endif
+
+#ifdef USE_CS_EEPROM
+WORD	cs_ee_base[2];		// reference baselines from EEPROM
+bit		cs_ee_valid;		// reference baselines loaded and not yet used
+BYTE	cs_ee_saved;		// 1 = a calibration block is in EEPROM, 2 = waiting to be written
+#endif
+
+#ifdef USE_CS_TEMPCOMP
+signed int	tc_k[2];		// learned baseline counts per mV of sensor (x256)
+WORD	tc_base[2];			// baseline at the last temperature sample
+WORD	tc_temp;			// TemperatureV at the last sample, 0 = none yet
+WORD	tc_hold[2];			// scans each baseline was frozen since the last sample
+WORD	tc_scans;			// scans since the last sample, stops at 0xFFFF
+bit		tc_due;				// new TemperatureV sample for cap_TempComp
+#endif
+
+#ifdef CS_BACKEND_CPS
+BYTE	cps_ovf;			// Timer0 overflows during the CPS count
+#endif
+
+#ifdef USE_PROXIMITY
+bit		ProxMode;			// 1 = proximity scan instead of key scan (cleared on wake)
+BYTE	ProxTick;			// ticks until the next proximity scan
+bit		ProxFirst;			// preload the proximity filters on the next scan
+bit		ProxPhase;			// FvrTick() phase while the proximity scan runs
+bit		ProxWake;			// set by the interrupt when a hand is detected
+bit		ProxLeave;			// set by main to end the proximity scan on the next scan tick
+bit		ProxResume;			// first key scan after the proximity scan, ProxRestore() is due
+WORD	ProxAvg;			// slow proximity baseline (x64)
+WORD	ProxFilt;			// filtered proximity reading (x2)
+#endif
+
+#ifdef USE_CS_MEDIAN
+WORD	med_ring[2][2];		// last 2 raw samples per button for the median filter
+#endif
 
 
 // system flags
@@ -79,7 +119,8 @@ union {
         BYTE    _update:1;
         BYTE    _BTN1:1;
         BYTE    _BTN2:1;
-        BYTE    unused:3;
+        BYTE    _reject:1;
+        BYTE    unused:2;
     } _flags;
 } _sys_flags;
 
@@ -106,12 +147,26 @@ union {
 #define BAT_LEVEL_MAX	1300  	// Set the leves for the battery level warnings
 #define BAT_LEVEL_MED	1150  	// Anything above MAX show all bars, above MED shows
 #define BAT_LEVEL_MIN	1000  	// 2 bars, above MIN 1 bar, below min no bars
+#define BAT_HYST		20		// mV either side of a level before the bars change
+
+#define BAT_LEVEL_LOW		BAT_LEVEL_MIN	// Battery manager enters Low below this
+#define BAT_LEVEL_CRITICAL	900				// and Critical below this
+#define BAT_HYST_STATE		50				// mV above the entry level to leave a state
 
 #define SPEAKER		LATB1		// Use PWM on P1C to drive the speaker 
 #define TEMP_EN		LATB2		// Used to turn sensor on and off to save power
 #define TEMP_IN		RB3			// AN9 used to read sensor
 #define BATV_IN		RA0			// AN0 used for measuring voltage on battery
 
+// Reset cause bits in PCON
+#define PCON_nBOR		0x01
+#define PCON_nPOR		0x02
+#define PCON_nRI		0x04
+#define PCON_nRMCLR		0x08
+#define PCON_STKUNF		0x40
+#define PCON_STKOVF		0x80
+#define PCON_CLEAR		0b00001111	// Set the n bits, clear the stack flags
+
 #define SW1 BTN1
 #define SW2 BTN2
 
@@ -142,6 +197,14 @@ union {
 // Internal VREF Configuration
 #define FVRCON_LOAD 0b00000010      // Disabled, but configured for 2.048V to ADC only
 
+// Capacitive Sensing module (CS_BACKEND_CPS)
+#define CPSCON0_LOAD	0b10001001	// CPSON, fixed refs, medium range (1.2uA), Timer0 from CPS osc
+#define OPTION_REG_CPS	0b10100001	// No pull ups, Timer0 on T0XCS clock, prescale 1:4
+									// ~800 counts a tick, not a proven bound, see CPS_COUNT_MAX
+#define CPS_COUNT_MAX	2047		// Counts are clamped here so avg (raw<<5) fits a WORD
+#define CPS_CH_BTN1		0			// CPS0 is RB0
+#define CPS_CH_BTN2		1			// CPS1 is RB1
+
 // PWM Configuration
 #define CCP3CON_LOAD	0b00001100  // PWM mode, output steering LSBs=0
 #define PSTR3CON_LOAD	0b00000001  // Steer output to P3A
@@ -149,15 +212,24 @@ union {
 #define T2CON_LOAD		0b00000100  // Pre & Post 1:1 and turn ON
 #define CCPR3L_LOAD		0			// Load zero to start with so no output
 
+// Sound step timer
+#define T4CON_LOAD		0b00000111	// Post 1:1, Pre 1:64, turn ON - 125KHz/64 = 1953Hz
+#define PR4_LOAD		19			// 1953Hz/20 = 97.7Hz, 10.24ms per step unit
+#define SND_STEP_T1		335			// 10.24ms in TMR1 counts for the battery gauge
+
 // Timer 1 configuration
 #ifdef CLOCK_EXTERNAL
  #define T1OSCSTART  0b10001100		// Start oscillator Before starting timer
+ #define T1CON_BOOT  0b00101101		// Fosc/4, 1:4, OSCEN, T1ON - 31.25KHz while T1OSC starts
+ #define TMR1H_BOOT	 0xF1			// 3840 counts, 122.9ms, 1.7% fast until T1OSC runs
  #define T1CON_LOAD  0b10001101		// Use T1OSC, 1:1, OSCEN, T1ON
  #define T1GCON_LOAD 0b00000000		// Do not use gating
  #define TMR1H_LOAD	 0xF0			// 32768 / 8 = 4096  
  #define TMR1L_LOAD	 0x00			// 0xFFFF - 4096 + 1 = 0xF000
 
  #define OSCCON_LOAD 0b00111010		// Internal Oscillator 500KHz
+ #define OSCCON_LF	 0b00000010		// LFINTOSC 31KHz for housekeeping
+ #define OSCCON_HF	 0b01101010		// HFINTOSC 4MHz for bursts of work
 
 #else
 	#error "MUST SELECT EXTERNAL OSCILLATOR OPTION"
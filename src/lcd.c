@@ -65,7 +65,7 @@
 *           000   7  
 *
 ***********************************************************/
-unsigned char map_numbers[]={
+const unsigned char map_numbers[]={
 								0b00111111,		// 0
 								0b00000110,		// 1
 								0b01101101,		// 2
@@ -89,8 +89,12 @@ unsigned char map_numbers[]={
 								0b00000000,		// SPACE
 								0b01111100, 	// P
 								0b01000000, 	// -
+								0b01100111, 	// d
+								0b01110110, 	// H
 						};
 							
+unsigned char lcd_frame[8];		// LCDDATA saved while the display is in standby
+unsigned char lcd_rl=LCDRL_LOAD;	// Ladder setting to restore on wake
 
 
 
@@ -98,6 +102,8 @@ unsigned char map_numbers[]={
 * Function: void lcd_init (void)
 *
 * Overview: Initialise the LCD module using settings defined in lcd.h
+*			The LCD starts on LFINTOSC, lcd_timebase() moves it over to
+*			T1OSC once the crystal is running.
 *
 * Input:    None
 *
@@ -107,7 +113,7 @@ unsigned char map_numbers[]={
 void lcd_init(void)
 {
     
-	LCDCON=LCDCON_LOAD;     // LCD Control Register - General Configuration
+	LCDCON=LCDCON_BOOT;     // LCD Control Register - General Configuration
 	LCDPS=LCDPS_LOAD;       // LCD Phase resister - Multiplexing/phse setup for LCD
 	LCDREF=LCDREF_LOAD;     // LCD Reference ladder settings
 	LCDCST=LCDCST_LOAD;     // LCD Contrast control register
@@ -121,6 +127,124 @@ void lcd_init(void)
 
 }
 
+/******************************************************************************
+* Function: void lcd_standby (void)
+*
+* Overview: Saves the frame and turns the LCD drive and the bias ladder off.
+*			The segments are cleared first so the glass is left with every
+*			pixel off and no DC across it. Timer1 keeps running.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void lcd_standby(void)
+{
+	lcd_frame[0]=LCDDATA0;
+	lcd_frame[1]=LCDDATA1;
+	lcd_frame[2]=LCDDATA3;
+	lcd_frame[3]=LCDDATA4;
+	lcd_frame[4]=LCDDATA6;
+	lcd_frame[5]=LCDDATA7;
+	lcd_frame[6]=LCDDATA9;
+	lcd_frame[7]=LCDDATA10;
+
+	lcd_clear();
+	LCDEN=0;				// Stop the drive
+	LCDRL=0;				// Ladder power off
+	LCDREF=0;				// Internal reference off
+}
+
+/******************************************************************************
+* Function: void lcd_wake (void)
+*
+* Overview: Turns the ladder and the drive back on with the frame saved by
+*			lcd_standby() so the display is back before the next redraw.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void lcd_wake(void)
+{
+	LCDDATA0=lcd_frame[0];
+	LCDDATA1=lcd_frame[1];
+	LCDDATA3=lcd_frame[2];
+	LCDDATA4=lcd_frame[3];
+	LCDDATA6=lcd_frame[4];
+	LCDDATA7=lcd_frame[5];
+	LCDDATA9=lcd_frame[6];
+	LCDDATA10=lcd_frame[7];
+
+	LCDREF=LCDREF_LOAD;
+	LCDRL=lcd_rl;
+	LCDEN=1;
+}
+
+/******************************************************************************
+* Function: void lcd_ladder (unsigned char rl, unsigned char cst)
+*
+* Overview: Sets the bias ladder power and the contrast. While the display
+*			is in standby the ladder setting is only kept for lcd_wake().
+*
+* Input:    unsigned char rl  -  LCDRL value
+*
+*           unsigned char cst  -  LCDCST value
+*
+* Output:   None
+*
+******************************************************************************/
+void lcd_ladder(unsigned char rl, unsigned char cst)
+{
+	lcd_rl=rl;
+	LCDCST=cst;
+	if(LCDEN) LCDRL=rl;
+}
+
+/******************************************************************************
+* Function: void lcd_rate (unsigned char lp)
+*
+* Overview: Sets the LCD prescaler and so the frame rate. The module is
+*			stopped for the change, the glitch is one frame at most.
+*
+* Input:    unsigned char lp  -  LCDPS LP<3:0> prescaler, 1:(lp+1)
+*
+* Output:   None
+*
+******************************************************************************/
+void lcd_rate(unsigned char lp)
+{
+	unsigned char on;
+
+	on=LCDEN;
+	LCDEN=0;
+	LCDPS=(LCDPS_LOAD & 0xF0) | (lp & 0x0F);
+	if(on) LCDEN=1;
+}
+
+/******************************************************************************
+* Function: void lcd_timebase (void)
+*
+* Overview: Moves the LCD clock from LFINTOSC to LCDCON_LOAD once T1OSC is
+*			running. The module is stopped for the change.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void lcd_timebase(void)
+{
+	unsigned char on;
+
+	on=LCDEN;
+	LCDEN=0;
+	LCDCON=LCDCON_LOAD & 0x7F;
+	if(on) LCDEN=1;
+}
+
 /******************************************************************************
 * Function: void lcd_clear (void)
 *
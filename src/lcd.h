@@ -51,6 +51,11 @@ extern void lcd_init(void);
 extern void lcd_clear(void);
 extern void lcd_clear_special(void);
 extern void lcd_putc(unsigned char num, char segment, char dot);
+extern void lcd_standby(void);
+extern void lcd_wake(void);
+extern void lcd_ladder(unsigned char rl, unsigned char cst);
+extern void lcd_rate(unsigned char lp);
+extern void lcd_timebase(void);
 
 
 
@@ -62,8 +67,10 @@ extern void lcd_putc(unsigned char num, char segment, char dot);
 
 #ifdef LCD_CLOCK_EXTERNAL					
  #define LCDCON_LOAD	0b10000111		// T1OSC - 32.768KHz external
+ #define LCDCON_BOOT	0b10001011		// LFINTOSC until T1OSC is running
 #else
  #define LCDCON_LOAD	0b10001011		// Internal Oscillator
+ #define LCDCON_BOOT	LCDCON_LOAD
 #endif
 
 
@@ -73,6 +80,28 @@ extern void lcd_putc(unsigned char num, char segment, char dot);
 //#define LCDRL_LOAD		0b01010001	// LCD REF - Low power mode
 #define LCDRL_LOAD		0b10010001		// LCD REF - Med Power mode (Better contrast)
 
+// Ladder power steps for USE_LCD_ADAPT, lowest current first
+// LCDRL: Type-A power<7:6>, Type-B power<5:4>, Type-A interval<2:0>
+// LCDCST: 0 is the most contrast
+#define LCD_STEP_0_RL	0b01010001		// Low/Low - fresh cell
+#define LCD_STEP_0_CST	0b00000010
+#define LCD_STEP_1_RL	0b10010001		// Med/Low - same as LCDRL_LOAD
+#define LCD_STEP_1_CST	0b00000001
+#define LCD_STEP_2_RL	0b10010011		// Med/Low, longer Type-A interval - tired cell
+#define LCD_STEP_2_CST	0b00000000
+#define LCD_STEP_3_RL	0b11010011		// High/Low - tired cell on cold glass
+#define LCD_STEP_3_CST	0b00000000
+#define LCD_STEPS		4
+
+// Frame rates for USE_LCD_ADAPT, slowest last. LCDPS prescaler LP<3:0>
+// Frame = 32768 / ((LP+1) x 32 x 4) for 1/4 mux on T1OSC, see tools/lcdcalc.c
+#define LCD_RATE_0_LP	1				// 128Hz - same as LCDPS_LOAD
+#define LCD_RATE_1_LP	2				// 85Hz
+#define LCD_RATE_2_LP	3				// 64Hz
+#define LCD_RATE_3_LP	4				// 51Hz - slowest without flicker
+#define LCD_RATES		4
+#define LCD_RATE_COLD	3				// Fastest rate allowed on cold glass
+
 #define LCDSE0_LOAD		0b11111110
 #define LCDSE1_LOAD		0b01101101
 
@@ -181,6 +210,8 @@ extern void lcd_putc(unsigned char num, char segment, char dot);
 #define CHAR_SPACE  20
 #define CHAR_P		21
 #define CHAR_MINUS  22
+#define CHAR_d		23
+#define CHAR_H		24
 #endif
 
 
@@ -7,15 +7,19 @@
 *		Time display in AM/PM or 24Hour formats
 *
 *		CVD cap sense for MODE and SET buttons
+*		(or the CPS module, #define CS_BACKEND_CPS in main.h)
 *
 *		Temperature sensor read and is displayed in Degrees C or F
 *
 *		Battery voltage monitoring and display
+*		With #define USE_BAT_GAUGE in main.h also the estimated days remaining
 *
 *		Boost from single AAAA battery to 3.3V
 *
 *		Programmable Audible Alarm External Piezo needed
 *		Introduced in V1.05 - #define USE_ALARM in main.h to enable
+*		ALARM_COUNT alarms shown on F1/F2 when enabled. While ringing SET
+*		snoozes and MODE turns it off, it stops by itself after 2 minutes.
 *
 *		Cap Sense Calibration. By touching both buttons at same time, waiting for 
 *		the F1 symbol, then releasing both buttons it will calibrate the cap sense.
@@ -23,6 +27,69 @@
 *		Note: If you calibrate while holding the board then you may need to hold the
 *		board for the keys to work. Removing the battery will reset the calibration
 *		to the factory default value.
+*		With #define USE_CS_EEPROM in main.h the calibration and a reference
+*		baseline are kept in data EEPROM and restored at power up instead.
+*		The stored baseline is checked once an hour and rewritten if it drifted.
+*
+*		Median-of-3 spike filter ahead of the cap sense press detector.
+*		#define USE_CS_MEDIAN in main.h to enable
+*
+*		Key events. The button levels are turned into queued press, release,
+*		long press and auto repeat events. In Setup holding SET auto repeats,
+*		faster the longer it is held. A single key press is held back for
+*		KEY_CHORD_TICKS so a two key press does not first step Setup.
+*
+*		Two pad arbitration. A palm, a water film or cross talk between the pads
+*		is rejected so it does not start a calibration or exit Setup.
+*		#define USE_CS_ARBITRATION in main.h to enable
+*
+*		Proximity scan. In the Standby power state the two pads are
+*		scanned together as one electrode at 2Hz. An approaching hand restarts
+*		the normal key scan. #define USE_PROXIMITY in main.h to enable
+*
+*		Temperature compensated cap sense baselines. A per button coefficient
+*		is learned online and used to move baselines held by a long press.
+*		#define USE_CS_TEMPCOMP in main.h to enable
+*
+*		Power manager. Active, Idle, Standby and Critical states from the time
+*		since the last key, the battery state and the time of day. PwrPolicy
+*		sets the scan rate and which subsystems run in each state.
+*		With #define USE_LCD_STANDBY the display is turned off after
+*		PWR_DARK_S without a key and during the PWR_DARK_START window.
+*
+*		LCD ladder power and contrast follow the battery voltage and the
+*		temperature. A SET press shows the settings, 'L' in the top right.
+*		The frame rate is set by the power state, slowest on cold glass.
+*		#define USE_LCD_ADAPT in main.h to enable
+*
+*		Clock manager. Everything runs at 500KHz by default. CLK_STRATEGY in
+*		main.h moves the main loop to 4MHz, or to 31KHz flag checks with 4MHz
+*		bursts only when there is work, the interrupt and sleep stay at 500KHz.
+*
+*		Fast boot. The LCD, the cap sense and the tick start on the internal
+*		oscillators and move over to T1OSC when the crystal is running. The
+*		version shows while it starts, BOOT_VERSION_TICKS at most.
+*		BootOscTicks (ticks until the crystal ran) and BootReady (tick of
+*		the first time or data display) are for profiling, read them in
+*		the debugger watch window after a reset.
+*
+*		Warm restart. The time and settings are kept in persistent RAM and
+*		restored after any reset other than power on if the copy checks.
+*
+*		Settings in EEPROM. 12/24hr, C/F and the alarms are written as a CRC
+*		checked record to the next slot of a ring when Setup is left, by
+*		the EEPROM interrupt. #define USE_SETTINGS_EE in main.h to enable
+*
+*		Low voltage checkpoint. A battery reading below CKPT_LEVEL or a
+*		sharp fall writes the time and the settings, Setup edits included,
+*		to EEPROM. After a power on the time comes back from it flagged as
+*		approximate. #define USE_CHECKPOINT in main.h to enable
+*
+*		History log. The temperature and battery every LOG_INTERVAL_MIN
+*		into a ring in EEPROM as 4 bit changes, about a week. MODE shows
+*		the temperature max (H), min (L), change over a day (r) and the
+*		battery change (b). tools/logdump.c decodes an EEPROM read out.
+*		#define USE_HISTORY in main.h to enable
 *
 *
 * Compiler Used: 
@@ -98,45 +165,284 @@ __CONFIG(WRT_OFF&PLLEN_OFF&STVREN_OFF&BORV_19&LVP_OFF);
 
 
 char TickCount=0;			// Counts ticks, 8 per second then clears
-char BatTempSel=0;			// Indicates if sampling Battery or Temperature
 char AMPM;  				// 0 = 12Hr Clock with A and P. 1 = 24Hr Clock with 10 sec
 char DEGCF;					// 0 = Degrees C,  1= Degrees F
+__persistent PERSIST Persist;	// Time and settings kept over a warm reset
+unsigned char ResetCause;	// PCON at start up
+unsigned char PersistLost=0;	// Ticks estimated lost by a warm restore, 0 = cold start
+unsigned char *EeSrc;		// Interrupt driven EEPROM write, next source byte
+unsigned char EeAddr;		// next address
+unsigned char EeLeft=0;		// bytes still to start, 0 = none
+EE_BUF EeBuf;				// Source of the write in progress, one user at a time
+#ifdef USE_CS_EEPROM
+unsigned char CsRefreshMin=0;	// Minutes since the stored baselines were checked
+#endif
+#ifdef USE_SETTINGS_EE
+unsigned char SetSeq=0;		// Sequence number of the newest settings record
+unsigned char SetSlot=EE_SET_SLOTS-1;	// and its ring slot
+#endif
+#ifdef USE_CHECKPOINT
+unsigned char CkptState=0;	// 0 = armed, 1 = written while low, 2 = written at Critical
+unsigned int CkptV=0;		// Unfiltered battery mV from the last reading, 0 = checked
+unsigned int CkptLastV=0;	// and the one before it
+bit TimeApprox;				// Time restored from a checkpoint, cleared when set in Setup
+#endif
+#ifdef USE_HISTORY
+unsigned char LogSeq=0;		// Sequence number of the block being filled
+unsigned char LogBlock=LOG_BLOCKS-1;	// and the block
+unsigned char LogN=LOG_DATA;	// Deltas in the block, LOG_DATA starts a new block
+unsigned char LogT,LogB;	// Last sample as logged
+unsigned int LogWait=0;		// Seconds to the next sample
+unsigned char HistN;		// Samples in the log
+unsigned char HistMin,HistMax;	// Temperature range of the log
+signed int HistDT,HistDB;	// Change over LOG_TREND_MIN
+unsigned char HistPage=0;	// History page showing, 0 = none
+unsigned char HistSec=0;	// Seconds left showing it
+const unsigned char HistCorner[HIST_PAGES]={CHAR_H,CHAR_L,CHAR_r,CHAR_b};	// Top right of each page
+#endif
 char SetupState=0;			// State for running (0) or setup modes (1) 
 
 unsigned int BatteryV, TemperatureV;// Battery and Temperature voltage results
+unsigned int BatteryQ3=0, TemperatureQ3=0;	// Filtered results in mV x8, 0 = no sample yet
+unsigned char BatBars=0;			// Battery bars shown, changed with hysteresis
+#ifdef USE_BAT_GAUGE
+// Alkaline AAAA discharge curve at clock currents, mV and % left
+const unsigned int BatCurveMv[]={900,1000,1050,1100,1150,1200,1250,1300,1350,1400,1500};
+const unsigned char BatCurvePct[]={ 0,   4,   9,  17,  28,  40,  55,  70,  80,  90, 100};
+unsigned int ClkAwake[CLK_SPEEDS];	// Main loop awake time this second per clock in TMR1 counts (30.5us)
+unsigned int ClkStamp;				// T1Stamp() at the last clock change
+unsigned int WakeCount=0;			// Main loop passes this second
+unsigned int ClkWakeNc=0;			// Main loop charge per pass in nA*s for CLK_STRATEGY
+unsigned int ClkWakeUs=0;			// Measured main loop awake time per pass in us
+unsigned int GaugeFvr=0;			// FVR on time this second in TMR1 counts
+unsigned int GaugePwm=0;			// Piezo PWM on time this second in TMR1 counts
+unsigned int GaugeAdc=0;			// FVR referenced conversions this second
+unsigned long GaugeQ=0;				// Charge in the gauge period in uA*s x256
+unsigned int GaugeSec=0;			// Seconds into the gauge period
+unsigned int GaugeUAQ2=0;			// Filtered average current in uA x4, 0 = none yet
+unsigned int GaugeDays=0xFFFF;		// Estimated days remaining, 0xFFFF = none yet
+#endif
+#ifdef USE_ALARM
+// Sound patterns {PR2, CCPR3L, length}, PWM is 125KHz/(PR2+1), 32 = 3.8KHz
+const SOUND_STEP SndClick[]={{32,16,1},{0,0,0}};				// Setup blink, 10ms
+const SOUND_STEP SndBeep[]={{32,16,5},{0,0,0}};					// Low battery, 50ms
+const SOUND_STEP SndChime[]={{30,15,8},{0,0,1},{40,20,12},{0,0,0}};	// High then low
+const SOUND_STEP SndAlarmSoft[]={{32,4,10},{0,0,1},{32,6,10},{0,0,1},	// Alarm start quiet
+								 {32,8,10},{0,0,1},{32,10,10},{0,0,2},{0,0,0}};
+const SOUND_STEP SndAlarm[]={{32,12,10},{0,0,1},{32,14,10},{0,0,1},	// then get louder
+							 {32,16,10},{0,0,1},{32,16,10},{0,0,2},{0,0,0}};
+const SOUND_STEP *SndStep=0;		// Step playing, 0 = silent
+unsigned char SndLeft;				// Time left in the step, 10ms for a tone or ticks for a rest
+bit SndTone;						// A tone is playing, Timer2 needs the CPU awake
+bit SndNew;							// SndStep set by SoundPlay, for the interrupt to load
+#endif
+#ifdef USE_BAT_RES
+bit SndRes;							// Take the battery readings on the first tone
+unsigned int SndRestQ3=0;			// Battery at rest, taken by the interrupt before the tone
+unsigned int SndLoadQ3=0;			// and half way through it, 0 = none yet
+unsigned int BatDropQ2=0;			// Filtered battery drop under the piezo load in mV x4
+unsigned int BatRes=0;				// Internal resistance in mOhm from BatDropQ2, 0 = none yet
+unsigned char BatResMin=0xFF;		// Min of the last measurement, one a minute at most
+#endif
+#ifdef USE_BAT_MANAGER
+unsigned char BatState=BAT_GOOD;	// BAT_GOOD, BAT_LOW or BAT_CRITICAL
+unsigned int BatAlertSec=0;			// Seconds until the next low battery alert
+#else
+unsigned char BatBeepSec=0xFF;		// Second of the last low battery beep
+#endif
+unsigned char ScanDiv=1;			// Cap sense runs every ScanDiv ticks
+unsigned char ScanSkip=0;			// Ticks left to skip
+const unsigned int BatLevel[3]={BAT_LEVEL_MIN,BAT_LEVEL_MED,BAT_LEVEL_MAX};
 unsigned int Time24,Time;			// Time 24/12hr results
 unsigned char Sec,Min,Hrs;			// Time seperated
 
 #ifdef USE_ALARM
-unsigned char AlarmMin,AlarmHrs;	// Alarm Time seperated
-unsigned int Alarm24;				// Alarm Time 24Hr Format
-bit AlarmEnabled;					// Alarm Enable/Disable bit
+unsigned char AlarmMin[ALARM_COUNT],AlarmHrs[ALARM_COUNT];	// Alarm Times seperated
+unsigned char AlarmOn;				// Alarm Enable/Disable bit per alarm
+unsigned int AlarmNext=0xFFFF;		// Next fire time in minutes of the day, 0xFFFF = none
+unsigned char AlarmNextIdx;			// Alarm at AlarmNext, ALARM_SNOOZED if it is the snooze
+unsigned int SnoozeAt=0xFFFF;		// Snooze fire time in minutes of the day, 0xFFFF = none
+unsigned char SnoozeIdx;			// Alarm that was snoozed
+unsigned char AlarmRing=0;			// Alarm ringing + 1, 0 = quiet
+unsigned char AlarmRingSec;			// Seconds it has been ringing
 #endif
 
-#define BAT_TEMP_COUNTER_PERIOD 80; // Test every 80/4=10 seconds to save power and 
-									// give more time to the cap sense
-unsigned char BAT_TEMP_COUNTER=0;	// Counter for Bat/Temp sampling - only do once in a while
+#define BAT_TEMP_COUNTER_PERIOD 80	// Test the battery every 80 x 1/4s (a full rate scan) = 20 seconds to
+									// save power and give more time to the cap sense
+unsigned char BatCounter=0;			// Counter for Battery sampling - only do once in a while
+unsigned int TempCounter=0;			// Counter for Temperature sampling
+unsigned int TempPeriod=TEMP_PERIOD_MIN;	// Current temperature interval, backs off when steady
+unsigned int TempRef=0;				// Temperature (mV x8) when the interval was last reset
+unsigned char FvrPending=0;			// FVR_xxx channels to convert in the next FVR session
+unsigned int FvrOnStamp;			// T1StampIsr() when the reference was turned on
+unsigned int FvrOnTime=0;			// FVR on time of the last session in TMR1 counts (30.5us)
 
 unsigned char CalibrationMode=0;	// Calibration Mode State
 
+#ifdef USE_CS_ARBITRATION
+unsigned char CS_RejectCnt=0;		// Scans the pads have been rejected in a row
+#endif
+
+unsigned int IdleSeconds=0;			// Seconds since the last key event
+
+unsigned char T1Boot=1;				// 1 = tick from Fosc/4 while T1OSC starts
+unsigned int BootOscTicks=0;		// Ticks before T1OSC was running
+unsigned char BootReady=0xFF;		// TickStamp at the first usable display, 0xFF = not yet
+
+const unsigned char ClkLoad[CLK_SPEEDS]={OSCCON_LF,OSCCON_LOAD,OSCCON_HF};
+unsigned char ClkSpeed=CLK_MID;		// CLK_xxx the main loop is running at
+
+const PWR_POLICY PwrPolicy[PWR_STATES]={	// What each subsystem does per power state
+	{1,					PWR_F_TEMP|PWR_F_ROTATE|PWR_F_SOUND|PWR_F_LCD,	1},	// Active
+	{2,					PWR_F_TEMP|PWR_F_ROTATE|PWR_F_SOUND|PWR_F_LCD,	2},	// Idle
+	{1,					PWR_F_PROX|PWR_F_TEMP|PWR_F_SOUND|PWR_F_LCD,	2},	// Standby, ProxScan() sets the rate
+	{BAT_CRIT_SCAN_DIV,	PWR_F_LCD,										3},	// Critical
+	{1,					PWR_F_PROX|PWR_F_TEMP,							3},	// Dark
+};
+unsigned char PwrState=PWR_ACTIVE;	// PWR_xxx power state
+unsigned int PwrStateSec=0;			// Seconds in the current state
+unsigned int PwrTime[PWR_STATES];	// Total minutes spent in each state, for profiling
+unsigned char PwrTimeSec=0;			// Seconds towards the next PwrTime minute
+
+#ifdef USE_LCD_ADAPT
+const unsigned char LcdStepRl[LCD_STEPS]={LCD_STEP_0_RL,LCD_STEP_1_RL,LCD_STEP_2_RL,LCD_STEP_3_RL};
+const unsigned char LcdStepCst[LCD_STEPS]={LCD_STEP_0_CST,LCD_STEP_1_CST,LCD_STEP_2_CST,LCD_STEP_3_CST};
+const unsigned int LcdLevel[2]={BAT_LEVEL_MED,BAT_LEVEL_MIN};	// Battery mV for steps 0/1
+unsigned char LcdBatStep=1;			// Step from the battery, 0 to 2
+bit LcdCold;						// 1 = one more step for cold glass
+unsigned char LcdStep=1;			// Step in use, starts at LCDRL_LOAD
+const unsigned char LcdRateLp[LCD_RATES]={LCD_RATE_0_LP,LCD_RATE_1_LP,LCD_RATE_2_LP,LCD_RATE_3_LP};
+unsigned char LcdRate=0;			// Frame rate in use, starts at LCDPS_LOAD
+unsigned char LcdDiagSec=0;			// Seconds left showing the ladder settings
+unsigned char LcdDiagPage=0;		// Diagnostic page showing, 0 = ladder
+#endif
+
+unsigned char TickStamp=0;			// Free running tick count from the interrupt
+unsigned char KeyStamp;				// TickStamp at the last KeyScan
+unsigned int KeyHeld;				// Ticks the current key state has been held
+unsigned int KeyNext;				// KeyHeld value for the next long/repeat event
+unsigned char KeyLast=0;			// Key state at the last KeyScan
+unsigned char KeyPend=0;			// Single key press held back for a chord
+unsigned char KeyQueue[KEY_QUEUE_SIZE];	// Queued event codes
+unsigned char KeyHead=0,KeyTail=0;	// Queue write and read positions
+
 /*****************************************************************************
 *                       Local Function Prototypes
 *****************************************************************************/
 void Init (void);           				// configure system peripherals and variables
 void cap_Sense(void);       				// perform cap touch function
 void IncTime(void);							// Increments time
+void TimeCalc(void);						// Updates Time24 and Time from Hrs and Min
 void ShowNumber(unsigned int num, char dp);	// Displays a number between 0 and 9999 on the LCD
-void BatteryDisplay(void);					// Displays the battery voltage
+void BatteryDisplay(unsigned char page);	// Displays the battery voltage or days left
+#ifdef USE_BAT_GAUGE
+unsigned char BatPercent(void);				// Charge left from the discharge curve
+void GaugeUpdate(void);						// Days remaining estimate, once a second
+#endif
+#ifdef USE_LCD_ADAPT
+void LcdAdapt(void);						// LCD ladder power, contrast and frame rate, once a second
+void LcdDisplay(void);						// Displays the ladder settings
+#endif
 void TemperatureDisplay (void);				// Displays the temperature
+void TemperatureShow(unsigned int q3, unsigned char corner, unsigned char rel);	// Displays a temperature
 void TimeDisplay(void);						// Displays the time
-void Setup(void);							// Runs the setup state machine options
-void Beep(unsigned int length);				// Makes a BEEP if hardware is attached and alarm enabled
+void Setup(unsigned char key);				// Runs the setup state machine options
+void SetupExit(unsigned char confirm);		// Leaves Setup and puts the alarms back
+#ifdef USE_ALARM
+void SoundPlay(const SOUND_STEP *pattern);	// Starts a sound pattern if hardware is attached
+void SoundLoad(void);						// Sets up the current step of the pattern, interrupt only
+void SoundOff(void);						// Stops the sound and gates the hardware off, interrupt only
+void SoundService(void);					// Main loop part of the sound engine
+unsigned char SoundBusy(void);				// A pattern is playing, read with the interrupt off
+#endif
 void CapSenseCalibrate(void);				// Runs the cap sense Calibration and detects jam condition
+void FvrTick(unsigned char phase);			// Battery and temperature scheduling per scan tick
+void FvrSession(void);						// Converts all pending FVR referenced channels
+unsigned char FvrDue(void);					// FVR_xxx channels due on the next tick
+void TempBackoff(unsigned int sample);		// Adapts the temperature sampling interval
+unsigned int FvrConvert(unsigned char channel);	// Oversampled conversion against the FVR
+unsigned int FvrFilter(unsigned int q3, unsigned int sample);	// Slow exponential filter
+void BatteryBars(void);						// Updates the battery bars
+#ifdef USE_BAT_RES
+unsigned int BatSample(void);				// Battery reading from the sound interrupt
+void BatResUpdate(unsigned int rest, unsigned int load);	// Internal resistance from 2 readings
+#endif
+#ifdef USE_BAT_MANAGER
+void BatteryManager(void);					// Battery state machine, once a second
+#endif
+unsigned char ScanDue(void);				// Divides the cap sense rate down
+void PwrSecond(void);						// Power state time keeping, once a second
+void PwrUpdate(void);						// Works out the power state
+void PwrEnter(unsigned char state);			// Applies the policy of a power state
+unsigned int T1Stamp(void);					// Sub tick time stamp from TMR1
+unsigned int T1StampIsr(void);				// T1Stamp() for the interrupt
+void ClockSet(unsigned char speed);			// Switches the main loop clock
+void BootTimebase(void);					// Moves the tick and the LCD over to T1OSC
+void PersistSave(void);						// Copies the time and settings to Persist
+void PersistRestore(void);					// Restores them after a warm reset
+unsigned char PersistSum(void);				// Byte sum of the checked part of Persist
+unsigned char EeStart(unsigned char addr, unsigned char *src, unsigned char len);	// Interrupt driven write
+void EeNext(void);							// Starts the next byte of the write
+void EeRead(unsigned char addr, unsigned char *dst, unsigned char len);	// Reads a block
+unsigned char Crc8(unsigned char *p, unsigned char len);	// CRC-8, polynomial 0x07
+#ifdef USE_SETTINGS_EE
+void SettingsFill(SETTINGS *s);				// Settings record from the current settings
+void SettingsSave(void);					// Writes the settings if they have changed
+void SettingsLoad(void);					// Loads the newest settings record
+void SettingsApply(SETTINGS *s);			// Makes a record the current settings
+#endif
+#ifdef USE_CHECKPOINT
+void CkptCheck(void);						// Battery trend check after each reading
+void CkptWrite(void);						// Writes the time and settings checkpoint
+void CkptLoad(void);						// Restores the time from it after a power on
+#endif
+#ifdef USE_HISTORY
+void LogInit(void);							// Finds the newest block of the log
+void LogSecond(void);						// Logs a sample every LOG_INTERVAL_MIN
+void LogSample(void);						// Writes a sample to the log
+void LogOpen(LOG_CUR *c);					// Puts a cursor before the oldest sample
+unsigned char LogNext(LOG_CUR *c);			// Decodes the next sample
+void HistStats(void);						// Range and trend from the log
+void HistKey(void);							// MODE press, next history page
+void HistDisplay(void);						// Displays a history page
+#endif
+#ifdef USE_CS_MEDIAN
+WORD Median3(WORD *s, WORD x);				// Returns the median of 3 cap sense samples
+#endif
+#ifdef USE_CS_ARBITRATION
+void cap_Arbitrate(void);					// Palm, water and cross talk rejection
+#endif
+#ifdef USE_CS_TEMPCOMP
+void cap_TempComp(void);					// Temperature compensation of the baselines
+#endif
+#ifdef USE_CS_EEPROM
+void CapSenseLoad(void);					// Loads the cap sense calibration from EEPROM
+void CapSenseSave(void);					// Stores the cap sense calibration in EEPROM
+void CapSenseRestore(void);					// Checks the stored baselines on the first scan
+void CapSenseRefresh(void);					// Follows a drifted baseline in EEPROM
+#endif
+#ifdef CS_BACKEND_CPS
+void cps_Start(BYTE channel);				// Starts the CPS count on a pad
+WORD cps_Read(void);						// Stops and returns the CPS count
+#endif
+#ifdef USE_PROXIMITY
+void ProxEnter(void);						// Switches the cap sense to the proximity scan
+void ProxExit(void);						// Restarts the key scan with the first button
+void ProxScan(void);						// Proximity scan with both pads as one electrode
+void ProxRestore(void);						// Checks the key baselines after the proximity scan
+#endif
+void KeyScan(void);							// Turns the button levels into events
+void KeyPut(unsigned char event);			// Adds an event to the queue
+unsigned char KeyGet(void);					// Takes the next event from the queue
 
 
 #ifdef USE_ALARM
-void AlarmDisplay(void);					// Alarm time Display function
-void AlarmCheck(void);						// Alarm Function
+void AlarmDisplay(unsigned char a);			// Alarm time Display function
+void AlarmCheck(void);						// Keeps a ringing alarm sounding
+void AlarmSecond(void);						// Alarm timing, once a second
+void AlarmSchedule(void);					// Works out the next alarm time
+unsigned char AlarmKey(unsigned char key);	// Snooze and off keys while ringing
+void AlarmStop(unsigned char snooze);		// Stops or snoozes the ringing alarm
 #endif
 
 #pragma config FOSC = INTOSC    // Oscillator Selection (INTOSC oscillator: I/O function on CLKIN pin)
@@ -147,38 +453,76 @@ void AlarmCheck(void);						// Alarm Function
 void main (void)
 {
 	
-	unsigned char Rotate,SetupDelay;
+	unsigned char Rotate,key,redraw;
 
 
 	Init();						// Initialise the Hardware
 	lcd_init();					// Initialise the LCD Peripheral
-	IncTime();					// Increment the time to force a time value update
+	TimeCalc();					// Time values from the preset or restored time
+#ifdef USE_ALARM
+	AlarmSchedule();			// First alarm time
+#endif
 
 	ShowNumber(VERSION,0x82);   // Display version on power up no leading 0
-	
-	// Display Version for at least one second
-	for(Rotate=8;Rotate>0;Rotate--)
-	{
-		while(tick==0);			// Wait for a tick to occur - 8 per second
-		tick=0;
-	}
+								// until T1OSC runs, see the main loop
 
-	AMPM=1;				// Start in AM/PM mode
 	Rotate=0;			// Clear data rotation count
-	SetupDelay=0;		// Clear delay count to enter the Setup
+	KeyStamp=TickStamp;	// Key timing starts now
+	redraw=1;
+#ifdef USE_BAT_GAUGE
+	ClkStamp=T1Stamp();
+#endif
 	
 
     while(1)
     {
+		ClockSet(CLK_HOUSE);	// Flag checks at the housekeeping clock
 		if(tick) // tick occurs 8x per second. 
 		{
 			tick=0;
+			redraw=1;
+			if(T1Boot)
+			{
+				BootOscTicks++;
+				if(T1OSCR) BootTimebase();	// Crystal running, move the tick over
+			}
 						
 			TickCount++;
+			Persist.ticks=TickCount;
 			if(TickCount>=8)  	// 8 ticks per second
 			{
+				ClockSet(CLK_BURST);	// Time, battery and gauge arithmetic
 				IncTime();		// Increment the Clock Time
 				TickCount=0;	
+				PersistSave();	// Time and settings for a warm restart
+#ifdef USE_ALARM
+				AlarmSecond();	// Fires on the minute, auto silence
+#endif
+				if(IdleSeconds < 0xFFFF) IdleSeconds++;
+#ifdef USE_BAT_MANAGER
+				BatteryManager();	// Battery state and alerts
+#endif
+#ifdef USE_CHECKPOINT
+				CkptCheck();		// Checkpoint before the cell collapses
+#endif
+#ifdef USE_CS_EEPROM
+				CapSenseRefresh();	// Stored baseline follows the drift
+#endif
+#ifdef USE_HISTORY
+				LogSecond();		// Temperature and battery history
+				if(HistSec && --HistSec == 0) HistPage=0;
+#endif
+#ifdef USE_BAT_GAUGE
+				GaugeUpdate();		// Days remaining estimate
+#endif
+				PwrSecond();		// Power state from idle time, battery and time of day
+#ifdef USE_SETTINGS_EE
+				if(SetupState==0) SettingsSave();	// Once Setup is done with them
+#endif
+#ifdef USE_LCD_ADAPT
+				LcdAdapt();			// Ladder power for the battery and temperature
+				if(LcdDiagSec) LcdDiagSec--;
+#endif
 				SEG_COLON=0;	// Clear the Colon
 	
 				Rotate++; 		// Rotates between time,temp and bat V
@@ -189,6 +533,14 @@ void main (void)
 			
 		}
 		
+		if(redraw || update || KeyHead != KeyTail	// Keys, redraw and Setup, not an EEPROM
+#ifdef USE_CS_TEMPCOMP							// or CPS overflow wake
+			|| tc_due
+#endif
+			) ClockSet(CLK_BURST);
+#ifdef USE_CS_TEMPCOMP
+		if(tc_due) cap_TempComp();	// Move frozen baselines with the temperature
+#endif
 		if (update > 0)    // new button data is available
     	{
             update = 0;
@@ -199,51 +551,109 @@ void main (void)
 			else SEG_F3=0;
 				
 			CapSenseCalibrate(); // Enter Calibration and auto fix state machine
+
+			KeyScan();			// Turn the button levels into events
 						
 		} // END if(update)
 			
+		key=KeyGet();			// Handle at most one key event per pass
+		if(key)
+		{
+			redraw=1;
+			IdleSeconds=0;
+			if(PwrState != PWR_ACTIVE) PwrUpdate();
+		}
+#ifdef USE_ALARM
+		if(key) key=AlarmKey(key);	// SET snoozes, MODE stops a ringing alarm
+#endif
 
+#ifdef USE_PROXIMITY
+		if(ProxWake)			// Hand detected - back to the full key scan
+		{
+			ProxWake=0;
+			redraw=1;
+			IdleSeconds=0;
+			PwrUpdate();
+		}
+#endif
 
-		if(SetupState==0) // Run Normally
+		if(redraw == 0)
+		{
+			// No tick or key, the loop only spins for a tone
+		}
+		else if(SetupState==0) // Run Normally
 		{
-			if(BTN2 && !BTN1)	// Test for only MODE being held for > 2 seconds
+			if(key == (KEY_EV_LONG|KEY_MODE)) SetupState=1; // MODE held for 2 seconds
+#ifdef USE_LCD_ADAPT
+			if(key == (KEY_EV_PRESS|KEY_SET))	// Ladder first, the next press the next page
 			{
-				SetupDelay++;
-				if(SetupDelay > 16) 
-				{
-					SetupState=1;
-					SetupDelay=0;
-				}
+				if(LcdDiagSec == 0 || ++LcdDiagPage >= LCD_DIAG_PAGES) LcdDiagPage=0;
+				LcdDiagSec=LCD_DIAG_S;
 			}
-			else	SetupDelay=0;
+#endif
+#ifdef USE_HISTORY
+			if(key == (KEY_EV_PRESS|KEY_MODE)) HistKey();	// Held on it goes to Setup
+			if(SetupState) HistPage=0;
+#endif
 
 	        
          	// Update the display	
-			if(Rotate==1||Rotate==2)TemperatureDisplay();				
+			if(T1Boot && BootOscTicks < BOOT_VERSION_TICKS)
+			{
+				// Version stays up while T1OSC starts
+			}
+			else if(!(PwrPolicy[PwrState].flags & PWR_F_LCD))
+			{
+				// Display off, the frame is kept by lcd_standby()
+			}
+#ifdef USE_LCD_ADAPT
+			else if(LcdDiagSec)LcdDisplay();
+#endif
+#ifdef USE_HISTORY
+			else if(HistPage)HistDisplay();
+#endif
+			else if(!(PwrPolicy[PwrState].flags & PWR_F_ROTATE))TimeDisplay();
+			else if(Rotate==1||Rotate==2)TemperatureDisplay();				
+			else if(Rotate==3)BatteryDisplay(0);
+#ifdef USE_BAT_GAUGE
+			else if(Rotate==4)BatteryDisplay(1);
+#endif
 			else TimeDisplay();
-			
+			if(BootReady == 0xFF && !(T1Boot && BootOscTicks < BOOT_VERSION_TICKS))
+				BootReady=TickStamp;	// Time to the first usable display, not the version
 		}
 		else  // if(SetupState) else
 		{
-			if(BTN1 && BTN2)		// If both buttons pressed - Exit setup mode
+			if(key == (KEY_EV_PRESS|KEY_BOTH))	// If both buttons pressed - Exit setup mode
 			{
-				SetupState=0;
+				SetupExit(1);
 			}
 			else
 			{
-				Setup();	// Run the Setup state machine if correct.
+				Setup(key);	// Run the Setup state machine if correct.
 			}
 		} //  END if(SetupState) else
+		redraw=0;
 
 		#ifdef USE_ALARM
 		AlarmCheck();
+		SoundService();
+		if(SndTone) continue;	// Timer2 stops in Sleep, stay awake while a tone plays
 		#endif
 
 
 
 
+		if(T1Boot) continue;	// Timer1 on Fosc/4 stops in Sleep
+		ClockSet(CLK_MID);		// The interrupt and the wake up run at 500KHz
+#ifdef USE_BAT_GAUGE
+		WakeCount++;
+#endif
 		SLEEP(); // Sleep after every pass to minimize current use
 		NOP();
+#ifdef USE_BAT_GAUGE
+		ClkStamp=T1Stamp();		// Sleep is not awake time
+#endif
 	}
 }
 
@@ -255,13 +665,87 @@ void main (void)
 ******************************************************************************/
 void __interrupt() INTERRUPT_InterruptManager (void)
 {
+#if CLK_STRATEGY != 0
+	unsigned char osccon;
+
+	osccon=OSCCON;
+	OSCCON=OSCCON_LOAD;		// Cap sense, ADC and sound timing are set for 500KHz
+#endif
+#ifdef CS_BACKEND_CPS
+	if(TMR0IF == 1)
+	{
+		TMR0IF=0;
+		cps_ovf++;			// High byte of the CPS count
+	}
+#endif
+	if(EEIF == 1)
+	{
+		EEIF=0;				// EEPROM byte written
+		if(EeLeft) EeNext();
+		if(WR == 0) EEIE=0;	// Done, or the rest was unchanged
+	}
+#ifdef USE_ALARM
+	if(TMR4IF == 1)
+	{
+		TMR4IF=0;			// 10ms sound step timer, only runs with a tone
+		if(SndNew)			// Or set by SoundPlay() for a new pattern
+		{
+			SndNew=0;
+#ifdef USE_BAT_RES
+			if(SndRes) SndRestQ3=BatSample();	// At rest just before the load
+#endif
+			SoundLoad();
+		}
+		else if(SndTone)
+		{
+#ifdef USE_BAT_GAUGE
+			GaugePwm+=SND_STEP_T1;
+#endif
+#ifdef USE_BAT_RES
+			if(SndRes && SndLeft == (SndStep->len >> 1))	// Boost settled under the load
+			{
+				SndLoadQ3=BatSample();
+				SndRes=0;
+			}
+#endif
+			if(--SndLeft == 0)
+			{
+				SndStep++;	// Next step of the pattern
+				SoundLoad();
+			}
+		}
+	}
+#endif
 	if(TMR1IF == 1)
 	{
-		TMR1H=TMR1H_LOAD;	// Only need to reload High.
+		if(T1Boot) TMR1H=TMR1H_BOOT;
+		else TMR1H=TMR1H_LOAD;	// Only need to reload High.
 		TMR1IF=0;			// Clear Flag
 		tick=1;				// Indicate Timer Tick
+		TickStamp++;		// Time base for the key events
+#ifdef USE_ALARM
+		if(SndStep && SndTone == 0 && --SndLeft == 0)	// Rest in a sound pattern
+		{
+			SndStep++;
+			SoundLoad();
+		}
+#endif
+		if(ScanDue())		// Slower scan when idle or on a critical battery
+		{
+#ifdef USE_PROXIMITY
+		if(ProxMode && CS_statevar==0)	// Switch over between key scans
+		{
+			if(ProxLeave) ProxExit();	// Asked for by PwrEnter()
+			else ProxScan();
+		}
+		else
+#endif
 		cap_Sense();		// Do Cap sense and ADC sampling
+		}
 	}
+#if CLK_STRATEGY != 0
+	OSCCON=osccon;			// Back to the main loop clock
+#endif
 }
         
 
@@ -278,11 +762,13 @@ void __interrupt() INTERRUPT_InterruptManager (void)
 ******************************************************************************/
 void Init (void)
 {
+#ifdef USE_ALARM
+	unsigned char a;
+#endif
 	
 	OSCCON=OSCCON_LOAD;
 
-	T1CON=T1OSCSTART;
-    while(T1OSCR==0);  			// Wait for Timer 1 oscillator to start up and run
+	T1CON=T1OSCSTART;			// Start the crystal, BootTimebase() switches over when it runs
 
     // preset system variables
     block       = 0b00000000;	// reset system flags
@@ -294,16 +780,33 @@ void Init (void)
 	Time24=Time=0;
 
 #ifdef USE_ALARM
-	AlarmMin=AlarmHrs=0;		// Preset Alarm values
-	Alarm24=0;
-	AlarmEnabled=1;
+	for(a=0;a<ALARM_COUNT;a++)	// Preset Alarm values
+	{
+		AlarmMin[a]=AlarmHrs[a]=0;
+	}
+	AlarmOn=0x01;				// Alarm 1 on
 
 								// PWM Configuration
-	CCP3CON=CCP3CON_LOAD;		// PWM mode, output steering LSBs=0
  	PSTR3CON=PSTR3CON_LOAD;		// Steer output to P1C
  	PR2=PR2_LOAD;				// 32.768KHz/16 = 2.048KHz
-	T2CON=T2CON_LOAD;			// Pre & Post 1:1 and turn ON
-	CCPR3L=CCPR3L_LOAD;			// Load zero to start with so no output
+	PR4=PR4_LOAD;				// Sound step timer
+	CCPR3L=0;					// CCP3, Timer2 and Timer4 only run during a tone
+	CCP3CON=0;
+	TMR2ON=0;
+	TMR4ON=0;
+	TMR4IF=0;
+	TMR4IE=1;
+#endif
+	AMPM=1;						// Start in AM/PM mode
+#ifdef USE_SETTINGS_EE
+	SettingsLoad();				// Settings from the last time Setup was used
+#endif
+	PersistRestore();			// Unless a warm reset kept the time and settings
+#ifdef USE_CHECKPOINT
+	CkptLoad();					// or the time from a checkpoint after a power on
+#endif
+#ifdef USE_HISTORY
+	LogInit();					// Carry on the history log
 #endif
 
 
@@ -321,8 +824,8 @@ void Init (void)
 
     //**** Timer1 configuration ****
     TMR1L   = TMR1L_LOAD;				// Set Time for initial count
-    TMR1H   = TMR1H_LOAD;
-    T1CON   = T1CON_LOAD;				// T1OSC, no pscale, OSC on, sync on, TMR1 on
+    TMR1H   = TMR1H_BOOT;
+    T1CON   = T1CON_BOOT;				// Fosc/4 until T1OSC runs, OSC on, TMR1 on
     T1GCON  = T1GCON_LOAD;				// disable TMR1 gate
 
     // ADC configuration for cap touch
@@ -333,8 +836,12 @@ void Init (void)
 
 
 	thold[0]=thold[1]=threshold;		// Load Default thresholds
+#ifdef USE_CS_EEPROM
+	CapSenseLoad();						// Replace with this unit's calibration if stored
+#endif
 	
 
+#ifdef CS_BACKEND_CVD
     // Start cap sense with first button
     BTN1_out;							// charge ADC Chold
     BTN1_high;
@@ -344,6 +851,19 @@ void Init (void)
     BTN1_in;							// disconnect output driver
     GO_nDONE = 0;						// reconnect ADC Chold to sensor
     GO_nDONE = 1;						// start conversion of value
+#else
+	// Start CPS counting on the first button
+	BTN1_in;							// pads are inputs for the CPS oscillator
+	BTN2_in;
+	OPTION_REG = OPTION_REG_CPS;		// Timer0 counts the CPS oscillator
+	TMR0IF=0;
+	TMR0IE=1;							// count Timer0 overflows
+	CPSCON0 = CPSCON0_LOAD;
+	CPSCON1 = CPS_CH_BTN1;				// as cps_Start(), which only the interrupt calls
+	cps_ovf = 0;
+	TMR0 = 0;
+	CPSON = 1;							// start the oscillator
+#endif
 
 	TMR1IF=0;
 	TMR1IE=1;
@@ -357,6 +877,9 @@ void Init (void)
 *
 * Overview: This function performs the capacitive touch function on 2 buttons
 *           It also does the measurement of the battery and the temperature. 
+*			State 0 reads BTN1 and starts BTN2, state 1 reads BTN2, runs the
+*			FVR session when the sensors are due and starts BTN1 again, so a
+*			scan is always 2 ticks. The sensors are scheduled by FvrTick().
 *
 * Input:    None
 *
@@ -369,6 +892,7 @@ void cap_Sense(void)
 	{
     	case 0:
     
+#ifdef CS_BACKEND_CVD
         raw[0] = (ADRESH << 8) + ADRESL;			// store previous value
         BTN2_out;									// charge ADC Chold
         BTN2_high;
@@ -378,67 +902,26 @@ void cap_Sense(void)
         BTN2_in;                         			// disconnect output driver
         GO_nDONE = 0;								// reconnect ADC Chold to sensor
         GO_nDONE = 1;								// start conversion of value
+#else
+		raw[0] = cps_Read();						// count over the last tick
+		cps_Start(CPS_CH_BTN2);
+#endif
         CS_statevar = 1;
-		if(BatTempSel==1 && BAT_TEMP_COUNTER==0)TEMP_EN=1;
-		else TEMP_EN=0;
+		FvrTick(0);									// Sensors on if due next tick
 		break;
 	
 		case 1:
     		// Store the buttons data
+#ifdef CS_BACKEND_CVD
     	    raw[1] = (ADRESH << 8) + ADRESL;    	// store previous value
+#else
+			raw[1] = cps_Read();					// BTN1 count is restarted below
+#endif
 
-			if(BAT_TEMP_COUNTER > 0) BAT_TEMP_COUNTER--;
-			if(BAT_TEMP_COUNTER == 0) 				// Skip case if not time to read sensors
-			{
-				//**** Start the conversion on the Battery or Temperature ****
-				ADON=0;								// Turn ADC OFF
-				ADCON1 = ADCON1_LOAD_2048;			// Set reference to 2.048V internal
-
-				FVREN=1;							// Turn Reference On
-				while(FVRRDY==0);					// Wait for reference to get stable
-
-				if(BatTempSel==0)					// Select Battery or Temeprature
-				{
-		 			ADCON0 = ADC_SEL_BATTERY;		// Select the battery channel turn ADON
-				}
-				else
-				{
-					ADCON0   = ADC_SEL_TEMPERATURE;	// Select the temperature channel turn ADON
-				}
-		
-     			NOP();NOP();						// Min delay before starting conversion
-        		NOP();NOP();
-				CS_statevar =2;
-        		GO_nDONE = 1;       				// start conversion of Battery or Temperature
-				break;
-			}
-						
-
-    	case 2:
-			if(BAT_TEMP_COUNTER == 0) 				// skip this if not time to read sensors
-			{
-    			FVREN=0; 							// Power the VREF off
-
-				if(BatTempSel ==0)
-				{
-					BatteryV=ADRES<<1;				// Store and connvert ADCRES as battery voltage
-					BatTempSel=1;
-				}
-				else
-				{
-					TEMP_EN=0;						// Power off temperature sensor
-					TemperatureV=ADRES<<1;			// Store and convert ADRES as Temperature voltage
-					BatTempSel=0;					// Reset Battery/temperature selector
-					BAT_TEMP_COUNTER=BAT_TEMP_COUNTER_PERIOD; // Restart the wait period
-				}
-
-				ADON=0;								// Turn ADC OFF
-				ADCON1 = ADCON1_LOAD_CAPS;			// Set up ADC for Cap sense
-				
-			}
-
+			FvrTick(1);								// Read the sensors if due
 
 			// Start conversion on the Button
+#ifdef CS_BACKEND_CVD
 	   		BTN1_out;								// charge ADC Chold
     	    BTN1_high;
   			ADCON0   = ADC_BTN1;
@@ -447,6 +930,9 @@ void cap_Sense(void)
         	BTN1_in;								// disconnect output driver
         	GO_nDONE = 0;							// reconnect ADC Chold to sensor
         	GO_nDONE = 1;							// start conversion of value
+#else
+			cps_Start(CPS_CH_BTN1);					// gate is always one full tick
+#endif
         	CS_statevar = 0;
 
         	update   = 1;							// both buttons scanned this pass
@@ -462,25 +948,78 @@ void cap_Sense(void)
 	//**** Run Cap sense Averaging *****
     if (update > 0)									// if both are done do press detect
     {
+#ifdef USE_PROXIMITY
+		if (ProxResume) ProxRestore();				// first key scan after the proximity scan
+#endif
+#ifdef USE_CS_MEDIAN
+		//**** Median-of-3 outlier rejection ****
+		// A single spike is only one of the 3 samples so it can never be
+		// the median. Costs one scan (250ms) of latency on press and release and
+		// about 100 instruction cycles (~0.8ms @ 500KHz) per scan.
+		if (first > 0)								// preload the ring on first pass
+		{
+			med_ring[0][0] = med_ring[0][1] = raw[0];
+			med_ring[1][0] = med_ring[1][1] = raw[1];
+		}
+		raw[0] = Median3(med_ring[0], raw[0]);		// rest of the chain sees the median
+		raw[1] = Median3(med_ring[1], raw[1]);
+#endif
+
         if (first > 0)								// on first pass through the loop
         {											// preset the average variables
             avg[0] = raw[0] << 5;
             avg[1] = raw[1] << 5;
+#ifdef USE_CS_EEPROM
+			if (cs_ee_valid) CapSenseRestore();		// stored baseline if a finger is on a pad
+#endif
 	 		BTN1 = 0;
             BTN2 = 0;
             first  = 0;
         }
-        else 										// if not first, check for press
-        {
+        											// check for press, also on the first
+        {											// pass so a restored baseline works at once
             BTN1 = 0;
             BTN2 = 0;
 
+            delta[0] = (avg[0] >> 5) - raw[0];		// finger lowers the reading
+            delta[1] = (avg[1] >> 5) - raw[1];
+            if (delta[0] > thold[0]) BTN1 = 1;		// if pressed set flags
+            if (delta[1] > thold[1]) BTN2 = 1;
+
+#ifdef USE_CS_ARBITRATION
+			cap_Arbitrate();						// drop palm, water and cross talk
+			if (reject)
+			{
+				if (CS_RejectCnt < CS_REJECT_MAX) CS_RejectCnt++;
+			}
+			else CS_RejectCnt = 0;
+			if (reject && CS_RejectCnt < CS_REJECT_MAX)			// hold baselines while rejecting
+			{
+#ifdef USE_CS_TEMPCOMP
+				if (tc_scans != 0xFFFF)				// stops at the top while sampling is off
+				{
+					tc_hold[0]++;
+					tc_hold[1]++;
+					tc_scans++;
+				}
+#endif
+				return;
+			}
+#endif
+
+#ifdef USE_CS_TEMPCOMP
+			if (tc_scans != 0xFFFF)					// count frozen scans for cap_TempComp
+			{
+				if (BTN1) tc_hold[0]++;
+				if (BTN2) tc_hold[1]++;
+				tc_scans++;
+			}
+#endif
+
             temp_avg = avg[0] >> 5;
-            if ((temp_avg - thold[0]) > raw[0]) BTN1 = 1;		// if pressed set flags
             if (BTN1 == 0) avg[0] = avg[0] - temp_avg + raw[0];	// if not average the raw value
 
             temp_avg = avg[1] >> 5;
-            if ((temp_avg - thold[1]) > raw[1]) BTN2 = 1;
             if (BTN2 == 0) avg[1] = avg[1] - temp_avg + raw[1];
         }
     }
@@ -488,665 +1027,3296 @@ void cap_Sense(void)
 }
 
 
-
 /******************************************************************************
-* Function: void IncTime (void)
+* Function: void FvrTick (unsigned char phase)
 *
-* Overview: This function increments the time by 1 second and
-*			updates minutes and hours as required.
-*			Time is stored in 24 hour format and AM/PM handled elseware
+* Overview: Battery and temperature scheduling, called from the interrupt
+*			by cap_Sense() or ProxScan() so the sensors keep their
+*			timetable whichever scan is running. Phase 0 turns the
+*			reference and the sensor on one tick before a session, phase
+*			1 counts the scan and runs the session when due. The counters
+*			are in 1/4 seconds, the time of a full rate scan. A scan
+*			slowed by the power state takes ScanDiv of them, so the
+*			battery and temperature periods stay the same in Idle and
+*			Critical.
 *
-* Input:    None
+* Input:    phase - 0 or 1, alternate ticks of a 2 tick scan
 *
 * Output:   None
 *
 ******************************************************************************/
-void IncTime(void)
+void FvrTick(unsigned char phase)
 {
-	Sec++;
-	if(Sec >59)				// Check for Seconds -> Minutes overflow
+	if(phase == 0)
 	{
-		Sec=0;
-		Min++;
-		if(Min >59)			// Check for Minutes -> Hours Overflow
+		if(FVREN == 0 && (FvrPending=FvrDue()) != 0)	// Sensors are read on the next tick
 		{
-			Min=0;
-			Hrs++;
-			if(Hrs > 23)	// Check for Hours -> Day Overflow
-			{
-				Hrs = 0;
-			}
-
+			FVREN=1;								// Turn Reference On one tick early so it
+			if(FvrPending & FVR_TEMPERATURE)TEMP_EN=1;	// and the sensor are settled by then
+			FvrOnStamp=T1StampIsr();
 		}
+		return;
 	}
-	//**** Create the 16 bit Hrs/Minutes ****
-	Time24=Hrs*100;
-	Time24+=Min;
-	Time=Time24;
-	if(AMPM==0)						// Check for 12Hr format, and convert down
-	{
-		if(Time > 1299) Time-=1200;	// Convert to 12 Hour for PM
-		if(Time <	99) Time+=1200; // Create Midnight for AM
-	}
+	if(BatCounter > ScanDiv) BatCounter-=ScanDiv;
+	else BatCounter=0;
+	if(TempCounter > ScanDiv) TempCounter-=ScanDiv;
+	else TempCounter=0;
+	if(FvrPending) FvrSession();			// Skip if not time to read sensors
 }
 
 
 /******************************************************************************
-* Function: void ShowNumber (void)
+* Function: void FvrSession (void)
 *
-* Overview: This displays a number on the screen
-*			Positive values only 0 to 9999
-*			Selectable decimal point
-*			Leading or no Leading zeros
+* Overview: Converts every FVR_xxx channel in FvrPending in one burst with the
+*			2.048V reference and powers the reference and the temperature
+*			sensor off again. FvrTick turns both on one tick before so
+*			there is normally no settle wait left here.
+*			The reference used to be turned on for one tick per channel, the
+*			battery and the temperature on separate scans, ~250ms per period.
+*			Now it is on once for one tick plus the burst, ~125ms. The
+*			measured time of the last session is kept in FvrOnTime.
+*			To add a channel add its FVR_xxx bit to FVR_ALL and a test below.
 *
-* Input:    unsigned int num  - Value between 0 and 9999
+* Input:    None
 *
-*			char db - location of decimal point 0=none, 1=left, 2=center, 4=right
-*					- Can add together to get a combination of locations
-*					- add 0x80 to remove leading zeros
 * Output:   None
 *
 ******************************************************************************/
-void ShowNumber(unsigned int num, char dp)
+void FvrSession(void)
 {
-	unsigned int temp;
-	unsigned char lead=0;
-
-	if(dp & 0x80)lead=1;	// If set remove leading zeros
+	unsigned int sample;
 
-	if(num > 9999) 			// If greater than 9999 then we have an Error
-	{
-		// Display Err
-		lcd_putc(CHAR_E,3,0);
-		lcd_putc(CHAR_r,2,0);
-		lcd_putc(CHAR_r,1,0);
-		lcd_putc(CHAR_SPACE,0,0);
-		return;
-	}
+	ADON=0;									// Turn ADC OFF
+	ADCON1 = ADCON1_LOAD_2048;				// Set reference to 2.048V internal
+	while(FVRRDY==0);						// Turned on a tick ago, should not wait
 
-	temp=num/1000;							// Thousands digit
-	if(lead==1 && temp==0 && (dp&1)==0)
+	if(FvrPending & FVR_BATTERY)
 	{
-		lcd_putc(CHAR_SPACE, 3,0);
+		sample=FvrConvert(ADC_SEL_BATTERY);
+		BatteryQ3=FvrFilter(BatteryQ3,sample);
+		BatteryV=BatteryQ3>>3;									// Store as mV
+#ifdef USE_CHECKPOINT
+		CkptV=sample>>3;										// Unfiltered for CkptCheck
+#endif
 	}
-	else
+	if(FvrPending & FVR_TEMPERATURE)
 	{
-		lcd_putc(temp, 3,dp&1);
-		lead=0;
+		sample=FvrConvert(ADC_SEL_TEMPERATURE);
+		TemperatureQ3=FvrFilter(TemperatureQ3,sample);
+		TemperatureV=TemperatureQ3>>3;							// Store as mV
 	}
-	num-=(temp*1000);
 
-	temp=num/100;							// Hundreds Digit
-	dp=dp>>1;
-	if(lead==1 && temp==0 && (dp&1)==0)
-	{
-		lcd_putc(CHAR_SPACE, 2,0);
-	}
-	else
-	{
-		lead=0;
-		lcd_putc(temp, 2,dp&1);
-	}
-	num-=(temp*100);
+	FVREN=0; 								// Power the VREF off
+	TEMP_EN=0;								// Power off temperature sensor
+	FvrOnTime=T1StampIsr()-FvrOnStamp;
+#ifdef USE_BAT_GAUGE
+	GaugeFvr+=FvrOnTime;
+#endif
 
-	temp=num/10;							// Tens Digit
-	dp=dp>>1;
-	if(lead==1 && temp==0 && (dp&1)==0)
+	ADON=0;									// Turn ADC OFF
+	ADCON1 = ADCON1_LOAD_CAPS;				// Set up ADC for Cap sense
+
+	if(FvrPending & FVR_BATTERY) BatCounter=BAT_TEMP_COUNTER_PERIOD; // Restart the wait period
+	if(FvrPending & FVR_TEMPERATURE)
 	{
-		lcd_putc(CHAR_SPACE, 1,0);
+		TempBackoff(sample);				// Restart with a new interval
+#ifdef USE_CS_TEMPCOMP
+		tc_due=1;							// cap_TempComp runs from the main loop
+#endif
 	}
-	else
-	{
-		lead=0;
-		lcd_putc(temp,1,dp&1);
-	}
-	num-=(temp*10);
+	FvrPending=0;
+}
 
-	// Dont check for lead - always print he last zero.
-	lcd_putc(num,0,0);						// Ones Digit
-}	
 
 /******************************************************************************
-* Function: void BatteryDisplay (void)
+* Function: unsigned char FvrDue (void)
 *
-* Overview: This function updates the battery status symbols
-*			And displays the Battery voltage on the screen
+* Overview: Returns the channels that will be read by the FVR session on the
+*			next tick, the counters go down by ScanDiv once per scan. The
+*			battery is always read. The temperature is read in the states
+*			with PWR_F_TEMP, Standby and Dark included as FvrTick also runs
+*			from the proximity scan.
 *
 * Input:    None
 *
-* Output:   None
+* Output:   FVR_xxx bits
 *
 ******************************************************************************/
-void BatteryDisplay(void)
+unsigned char FvrDue(void)
 {
-	// Update Segments
-	SEG_BAT2=SEG_BAT3=SEG_BAT4=0;
-	SEG_BAT1=1;								// Battery Outline always displayed
-	SEG_COLON=0;
-	
-	// No Bars indicates battery is below BAT_LEVEL_MIN and should be replaced
-	if(BatteryV > BAT_LEVEL_MIN)SEG_BAT2=1;	// One Bar
-	if(BatteryV > BAT_LEVEL_MED)SEG_BAT3=1;	// Two Bars
-	if(BatteryV > BAT_LEVEL_MAX)SEG_BAT4=1;	// Three Bars
-
-
-	// Display Voltage on the display
-	ShowNumber(BatteryV,1);					// Print the voltage
-		
-	lcd_putc(CHAR_b,4,0); 					// Display a "b" in the top right corner
-	
-
-	if(BatteryV < BAT_LEVEL_MIN)Beep(100);	// Alert user to Low Battery
+	unsigned char due=0;
 
+	if(BatCounter <= ScanDiv) due|=FVR_BATTERY;
+	if(!(PwrPolicy[PwrState].flags & PWR_F_TEMP)) return due;	// No temperature in this state
+	if(TempCounter <= ScanDiv) due|=FVR_TEMPERATURE;
+	return due;
 }
 
+
 /******************************************************************************
-* Function: void TemperatureDisplay (void)
+* Function: void TempBackoff (unsigned int sample)
 *
-* Overview: This displays the temperature on the screen
+* Overview: Adapts the temperature sampling interval. While the readings stay
+*			within TEMP_DEADBAND of the reading taken when the interval was
+*			last reset the interval doubles, up to TEMP_STALE_MAX seconds.
+*			A reading outside the deadband returns to TEMP_PERIOD_MIN.
+*			Comparing with that reference and not the last reading means a
+*			slow drift still brings the fast rate back.
 *
-* Input:    None
+* Input:    sample - Unfiltered reading in mV x8
 *
 * Output:   None
 *
 ******************************************************************************/
-void TemperatureDisplay (void)
-{	
-	unsigned int result, minus_flag;
-	SEG_COLON=0;
-	
-
-	result = TemperatureV;	
-	minus_flag = 0;
-	if (result < T_OFFSET_ZERO){
-		result = T_OFFSET_ZERO - result;
-		minus_flag = 1;
-	} else 
-		result -= T_OFFSET_ZERO;        // Shift by the 0 degree offset (400mV for MCP9701)
-	result = result * 10;			// scale up so we can do integer math to calc temperature
-    result = result / T_DIVISOR;	// 19.5mV/degree (195)for MCP9701 which scales down at the same time
+void TempBackoff(unsigned int sample)
+{
+	unsigned int diff;
 
-	result*=10; 					// Shift for the display so we can put a c or f in the right digit	
+	if(sample > TempRef) diff=sample-TempRef;
+	else diff=TempRef-sample;
 
-	if(DEGCF==1)
+	if(TempRef == 0 || diff > (TEMP_DEADBAND<<3))	// First sample or changing
 	{
-		// Calculate Farenheight
-		result=((18*result)/10)+320;// Tf = (9/5)*Tc+32; 9/5=1.8 or 18 in our case since we are x10
-		ShowNumber(result,0x80);	// Display the temperature in F
-		lcd_putc(CHAR_F,0,0);	
+		TempRef=sample;
+		TempPeriod=TEMP_PERIOD_MIN;
 	}
-	else
+	else if(TempPeriod < TEMP_PERIOD_MAX)			// Steady, back off
 	{
-		// Display in Degrees C
-		ShowNumber(result,0x80);	// Display temperature remove leading zeros
-		lcd_putc(CHAR_c,0,0);		// Add the 'c'
+		TempPeriod<<=1;
+		if(TempPeriod > TEMP_PERIOD_MAX) TempPeriod=TEMP_PERIOD_MAX;
 	}
-	
-	lcd_putc(CHAR_t,4,0); 			// Display a "t" in the top right corner to indicate Temperature
-	if(minus_flag) lcd_putc(CHAR_MINUS,3,0);
-
-	SEG_BAT1=1;								// Battery Outline always displayed
-	SEG_BAT2=SEG_BAT3=SEG_BAT4=0;
-	// No Bars indicates battery is below BAT_LEVEL_MIN and should be replaced
-	if(BatteryV > BAT_LEVEL_MIN)SEG_BAT2=1;	// One Bar
-	if(BatteryV > BAT_LEVEL_MED)SEG_BAT3=1;	// Two Bars
-	if(BatteryV > BAT_LEVEL_MAX)SEG_BAT4=1;	// Three Bars    
+	TempCounter=TempPeriod;
 }
 
 
 /******************************************************************************
-* Function: void TimeDisplay (void)
+* Function: unsigned int FvrConvert (unsigned char channel)
 *
-* Overview: This function displays the time in the appropiate format
+* Overview: Runs 4^ADC_OVS_N conversions back to back and decimates them.
+*			ADCON1 and the reference must already be set up. Each conversion
+*			is ~12 TAD on FRC plus the loop, about 100us at 500KHz.
+*			One count of the 10 bit result is 2mV. The sum of 4^n samples
+*			shifted right by n has n more bits, the result is returned
+*			scaled to mV x8 for any n (up to 2, 16 samples, 12 bits).
+*			The noise on the pin acts as the dither for the extra bits.
 *
-* Input:    None
+* Input:    ADCON0 value for the channel (with ADON)
 *
-* Output:   None
+* Output:   Reading in mV x8
 *
 ******************************************************************************/
-void TimeDisplay(void)
+unsigned int FvrConvert(unsigned char channel)
 {
-	unsigned char Temp;
-	
-	if(AMPM==0)
-	{
-		// 12 Hour format 
-		ShowNumber(Time, 0x80);				// Display 12Hr Time with no leading zeros
-		if(Hrs > 11)lcd_putc(CHAR_P,4,0);	// Display an A or P in the top right corner
-		else lcd_putc(CHAR_A,4,0);
-	}
-	else
+	unsigned int sum=0;
+	unsigned char i;
+
+	ADCON0 = channel;						// Select the channel turn ADON
+	NOP();NOP();							// Min delay before starting conversion
+	NOP();NOP();
+	for(i=0;i<(1<<(2*ADC_OVS_N));i++)
 	{
-		// 24 Hour format 
-		ShowNumber(Time24, 0);				// Display 24 Hour time
+		GO_nDONE = 1;
+		while(GO_nDONE);
+		sum+=ADRES;							// Max 16 x 1023, no overflow
 	}
-    lcd_putc(CHAR_SPACE,4,0);
+#ifdef USE_BAT_GAUGE
+	GaugeAdc+=i;
+#endif
+	return sum<<(4-2*ADC_OVS_N);			// (sum>>n) is 10+n bits of 2/2^n mV
 }
 
 
 /******************************************************************************
-* Function: void Setup (void)
+* Function: unsigned int FvrFilter (unsigned int q3, unsigned int sample)
 *
-* Overview: This function lets user set up time and other things
+* Overview: Exponential filter, moves 1/2^ADC_FILTER_SHIFT of the way to the
+*			new sample. The first sample (q3 = 0) is taken as is.
+*			With a sample every BAT_TEMP_COUNTER_PERIOD (~20s) and a shift
+*			of 2 a step settles to 90% in about 8 samples. The temperature
+*			is back at that rate whenever it is changing (TempBackoff).
 *
-* Input:    None
+* Input:    q3 - Filtered value in mV x8, sample - New reading in mV x8
 *
-* Output:   None
+* Output:   New filtered value
 *
 ******************************************************************************/
-#define KEY_CHECK 4  // Times through before checking a key and blinking display
-void Setup(void)
+unsigned int FvrFilter(unsigned int q3, unsigned int sample)
 {
-	static char Blink=0;
-	
-	if(SetupState < 7)
-	{
-		TimeDisplay();  		// Display for Time based settings
-	}
-	else if (SetupState < 10)
-	{	
-		TemperatureDisplay();	//  Display for Temperature settings
-		SEG_COLON=0;			// Remove the auto Colon 
-	}
-	#ifdef USE_ALARM
-	else
-	{
-		AlarmDisplay(); 		// Display for Alarm based settings
-	}
-	#endif
-	
-	
-
-	Blink++;
-	if(Blink < KEY_CHECK) return;
-	Blink=0;
-	
-	switch(SetupState)
-	{
-		case 1: // First time in - Blink  Hrs, wait for Mode button Release
-			lcd_putc(CHAR_SPACE,3,0);
-			lcd_putc(CHAR_SPACE,2,0);
-			if(BTN2==0) SetupState++;
-			break;
-
-		case 2: // Set Hours
-			lcd_putc(CHAR_SPACE,3,0);
-			lcd_putc(CHAR_SPACE,2,0);
-			
-			if (BTN1==1)
-			{
-				Hrs++;
-				if(Hrs > 23)Hrs=0;
-				Sec=0; // Clear seconds only when changing the time
-			}
-			else if(BTN2==1)
-			{
-				SetupState++;
-			}
-			
-			break;
-
-		case 3: // Blink Minutes - wait for Mode to be released
-			lcd_putc(CHAR_SPACE,1,0);
-			lcd_putc(CHAR_SPACE,0,0);
-			if(BTN2==0) SetupState++;
-			
-			break;
-
-		case 4: // Set Minutes
-			lcd_putc(CHAR_SPACE,1,0);
-			lcd_putc(CHAR_SPACE,0,0);
-			
-			if (BTN1==1)
-			{
-				Min++;
-				if(Min > 59)Min=0;
-				Sec=0;				// Clear seconds only when changing the time
-			}
-			else if(BTN2==1)
-			{
-				SetupState++;
-			}
-			break;
-
+	if(q3 == 0) return sample;
+	if(sample > q3) return q3 + ((sample - q3) >> ADC_FILTER_SHIFT);
+	return q3 - ((q3 - sample) >> ADC_FILTER_SHIFT);
+}
 
-		case 5: // Blink AM/PM/24 - wait for Mode to be released
-			lcd_putc(CHAR_SPACE,4,0);
-			if(BTN2==0) SetupState++;
-			break;
 
+/******************************************************************************
+* Function: unsigned int T1Stamp (void)
+*
+* Overview: Time stamp in TMR1 counts (30.5us) from the low 4 bits of
+*			TickStamp and the count within the tick. Wraps every 2 seconds
+*			so only for measuring short times. Main loop only, the
+*			interrupt has T1StampIsr().
+*
+* Input:    None
+*
+* Output:   Time stamp
+*
+******************************************************************************/
+unsigned int T1Stamp(void)
+{
+	unsigned char l,h;
 
-		case 6:	// Change AM/PM/24
-			lcd_putc(CHAR_SPACE,4,0);
-			if (BTN1==1)
-			{
-				if(AMPM==0)
-				{
-					if(Hrs < 12)Hrs+=12;	// Move to PM
-					else AMPM=1;			// Change to 24Hr Format
-				}
-				else
-				{
-					if(Hrs > 11)Hrs-=12; 	// Move to AM
-					AMPM=0;
-				}
+	h=TMR1H;
+	l=TMR1L;
+	if(h != TMR1H)							// Low byte rolled over between the reads
+	{
+		h=TMR1H;
+		l=TMR1L;
+	}
+	return (((unsigned int)TickStamp << 12) | ((unsigned int)(h & 0x0F) << 8)) + l;
+}
 
 
-			}
-			else if(BTN2==1)
-			{
-				SetupState++; 	
-			}
-			break;
+/******************************************************************************
+* Function: unsigned int T1StampIsr (void)
+*
+* Overview: The same stamp as T1Stamp() for the interrupt. XC8 would have
+*			to duplicate a function called from both the interrupt and
+*			main, so each side has its own.
+*
+* Input:    None
+*
+* Output:   Time stamp
+*
+******************************************************************************/
+unsigned int T1StampIsr(void)
+{
+	unsigned char l,h;
 
-		case 7: // C or F Wait for release of button
-			lcd_putc(CHAR_SPACE,0,0); 		// blank C/F character;
-			if(BTN2==0) SetupState++;
-			break;
+	h=TMR1H;
+	l=TMR1L;
+	if(h != TMR1H)							// Low byte rolled over between the reads
+	{
+		h=TMR1H;
+		l=TMR1L;
+	}
+	return (((unsigned int)TickStamp << 12) | ((unsigned int)(h & 0x0F) << 8)) + l;
+}
 
-		case 8: // C or F 
-			lcd_putc(CHAR_SPACE,0,0);		 // blank C/F character
-			if (BTN1==1)
-			{
-				if(DEGCF==0) DEGCF=1;
-				else DEGCF=0;
 
-			}
-			else if(BTN2==1)
-			{
-				SetupState++; 				// Move to Next state
-			}
-			break;
+/******************************************************************************
+* Function: void ClockSet (unsigned char speed)
+*
+* Overview: Switches the main loop clock and with USE_BAT_GAUGE adds the
+*			time since the last call to the speed it ran at. Called at least
+*			once a pass so the 2 second T1Stamp() wrap is never reached.
+*			While a sound plays the clock stays at 500KHz as Timer2 and
+*			Timer4 run from Fosc/4. The interrupt always runs at 500KHz.
+*
+* Input:    unsigned char speed  -  CLK_xxx
+*
+* Output:   None
+*
+******************************************************************************/
+void ClockSet(unsigned char speed)
+{
+#ifdef USE_BAT_GAUGE
+	unsigned int now;
 
-		case 9: // Wait for release of button to Exit
-			if(BTN2==1) break;
-			SetupState++;
-			
-// Following options are for the ALARM setting #define USE_ALARM in main.h
+	now=T1Stamp();
+	ClkAwake[ClkSpeed]+=(unsigned int)(now-ClkStamp);
+	ClkStamp=now;
+#endif
 #ifdef USE_ALARM
-		case 10: // Blink Alarm Hrs
-			lcd_putc(CHAR_SPACE,3,0);
-			lcd_putc(CHAR_SPACE,2,0);
-			if(BTN2==0) SetupState++;
-			break;
-
-		case 11: // Set Alarm Hours
-			lcd_putc(CHAR_SPACE,3,0);
-			lcd_putc(CHAR_SPACE,2,0);
-			
-			if (BTN1==1)
-			{
-				AlarmHrs++;
-				if(AlarmHrs > 23)AlarmHrs=0;
-			}
-			else if(BTN2==1)
-			{
-				SetupState++;
-			}
-			break;
-
-		case 12: // Blink Alarm Minutes
-			lcd_putc(CHAR_SPACE,1,0);
-			lcd_putc(CHAR_SPACE,0,0);
-			if(BTN2==0) SetupState++;
-			break;
-
-		case 13: // Set Alarm Minutes
-			lcd_putc(CHAR_SPACE,1,0);
-			lcd_putc(CHAR_SPACE,0,0);
-			
-			if (BTN1==1)
-			{
-				AlarmMin++;
-				if(AlarmMin > 59)AlarmMin=0;
-			}
-			else if(BTN2==1)
-			{
-				SetupState++;
-			}
-			break;
-
-		case 14: // Blink On/Off
-			lcd_putc(CHAR_SPACE,4,0);
-			if(BTN2==0) SetupState++;
-			break;
-
-
-		case 15: // Turn On or Off
-			lcd_putc(CHAR_SPACE,4,0);
-		
-			if (BTN1==1)
-			{
-				if(AlarmEnabled)AlarmEnabled=0;
-				else AlarmEnabled=1;
-			}
-			else if(BTN2==1)
-			{
-				SetupState++;
-			}
-			if(AlarmEnabled)Beep(100);
-			break;
-
-		
-
+	if(SoundBusy()) speed=CLK_MID;			// Tone pitch and step length
 #endif
-
-
-		default: 
-			if(BTN2==1)break; // Wait for Button to be released for the Exit
-			SetupState=0; 	  // Exit
-		
-
-
-	} // END: switch(SetupState)
-
-	IncTime();   	// Updates the time if anything was changed. This updates the values
-					// Since SEC is set to 0 to stop the clock this will not cause a roll over
+	if(T1Boot) speed=CLK_MID;				// The boot tick is Fosc/4
+	if(speed == ClkSpeed) return;
+	ClkSpeed=speed;
+	OSCCON=ClkLoad[speed];
 }
 
 
-
 /******************************************************************************
-* Function: void AlarmCheck (void)
+* Function: void BootTimebase (void)
 *
-* Overview: This function test the alarm time and sounds the alarm if appropiate
-*			It will do this 32 times (aprox 4 seconds)
+* Overview: Called on a tick once T1OSCR is set. Timer1 carries on counting
+*			from T1OSC with the normal reload and the LCD clock moves from
+*			LFINTOSC to T1OSC. Sleep is allowed from the next pass.
 *
 * Input:    None
 *
 * Output:   None
 *
 ******************************************************************************/
-#ifdef USE_ALARM
-void AlarmCheck(void)
+void BootTimebase(void)
 {
-	static char alarmcount;
-	if(Alarm24==Time24 && AlarmEnabled==1)	// Use 24hr formats to check Alarm 
-	{
-		if(Sec==0)alarmcount=0;				// clear the alarm count if in the first second
-		if(alarmcount<32)					
-		{
- 			Beep(1000);						// Make some noise
-			alarmcount++;					// Increment the alarm counter till we are done
-		}
-	}
-
+	GIE=0;
+	T1CON=T1CON_LOAD;						// T1OSC, no pscale, OSC on, sync on, TMR1 on
+	T1Boot=0;
+	GIE=1;
+	lcd_timebase();
 }
-#endif
+
 
 /******************************************************************************
-* Function: void AlarmDisplay (void)
+* Function: unsigned char PersistSum (void)
 *
-* Overview: This function displays the Alarms time in 24 Hour format only
+* Overview: Byte sum of Persist from hrs up to, not including, sum.
 *
 * Input:    None
 *
-* Output:   None
+* Output:   Sum
 *
 ******************************************************************************/
-#ifdef USE_ALARM
-void AlarmDisplay(void)
+unsigned char PersistSum(void)
 {
+	unsigned char *p,s=0;
 
-	SEG_F1=1;SEG_F2=0;
-
-	//Calculate 24 Hour Alarm Time (This updates the actual alarm time as well)
-	Alarm24=(AlarmHrs*100) + AlarmMin;
-
-	// 24 Hour format - display seconds with leading zeros
-	ShowNumber(Alarm24, 0);
-
-	// Show n for On or a o for Off
-	if(AlarmEnabled) lcd_putc(CHAR_n,4,0);
-	else lcd_putc(CHAR_o,4,0);
-	
+	for(p=&Persist.hrs;p<&Persist.sum;p++) s+=*p;
+	return s;
 }
-#endif // USE_ALARM
 
 
 /******************************************************************************
-* Function: void Beep (void)
+* Function: void PersistSave (void)
 *
-* Overview: This function Does a short Beep.
-*			Only works is a Piezo is attached, and the Alarm is enabled
+* Overview: Copies the time and settings to the persistent RAM once a second.
+*			The signature is cleared while the copy changes so a reset part
+*			way through is seen as invalid.
 *
 * Input:    None
 *
 * Output:   None
 *
 ******************************************************************************/
-void Beep(unsigned int length)
+void PersistSave(void)
 {
 #ifdef USE_ALARM
-	PR2=32;
-	CCPR3L=16;
-	while(length--);
-	CCPR3L=0;
-#endif	// USE_ALARM
+	unsigned char a;
+#endif
+
+	Persist.sig=0;
+	Persist.ticks=TickCount;				// 0, the second has just rolled
+	Persist.hrs=Hrs;
+	Persist.min=Min;
+	Persist.sec=Sec;
+	Persist.ampm=AMPM;
+	Persist.degcf=DEGCF;
+#ifdef USE_ALARM
+	for(a=0;a<ALARM_COUNT;a++)
+	{
+		Persist.alarm_hrs[a]=AlarmHrs[a];
+		Persist.alarm_min[a]=AlarmMin[a];
+	}
+	Persist.alarm_on=AlarmOn;
+#endif
+	Persist.sum=-PersistSum();
+	Persist.sig=PERSIST_SIG;
 }
 
+
 /******************************************************************************
-* Function: void CapSenseCalibrate (void)
-*
-* Overview: Runs the cap sense Calibration and detects jam condition
+* Function: void PersistRestore (void)
 *
+* Overview: Called from Init. Keeps PCON in ResetCause and sets it ready for
+*			the next reset. After a power on reset the RAM is random and the
+*			defaults stay. After any other reset (MCLR, RESET, brown out,
+*			stack) the time and settings are restored if the signature, the
+*			sum and the ranges check. The tick cut short by the reset is
+*			counted in PersistLost and added back.
 *
 * Input:    None
 *
 * Output:   None
 *
 ******************************************************************************/
-void CapSenseCalibrate(void)
+void PersistRestore(void)
 {
-	static unsigned char CalCounter;
-	static unsigned int Press[2];
+#ifdef USE_ALARM
+	unsigned char a;
+#endif
+
+	ResetCause=PCON;
+	PCON=PCON_CLEAR;
+	PersistLost=0;
+
+	if((ResetCause & PCON_nPOR) == 0) return;		// Power on
+	if(Persist.sig != PERSIST_SIG) return;
+	if((unsigned char)(PersistSum() + Persist.sum) != 0) return;
+	if(Persist.hrs > 23 || Persist.min > 59 || Persist.sec > 59 || Persist.ticks > 7) return;
+
+	Hrs=Persist.hrs;
+	Min=Persist.min;
+	Sec=Persist.sec;
+	AMPM=Persist.ampm;
+	DEGCF=Persist.degcf;
+#ifdef USE_ALARM
+	for(a=0;a<ALARM_COUNT;a++)
+	{
+		if(Persist.alarm_hrs[a] > 23 || Persist.alarm_min[a] > 59) continue;
+		AlarmHrs[a]=Persist.alarm_hrs[a];
+		AlarmMin[a]=Persist.alarm_min[a];
+	}
+	AlarmOn=Persist.alarm_on;
+#endif
+	TickCount=Persist.ticks + PERSIST_LOST_TICKS;	// Rolls the second on the next tick if over
+	PersistLost=PERSIST_LOST_TICKS;
+}
+
+
+/******************************************************************************
+* Function: void cap_TempComp (void)
+*
+* Overview: Temperature compensation of the cap sense baselines. Called from
+*			the main loop when a new TemperatureV sample arrives (every
+*			TempPeriod quarter seconds), the long arithmetic stays out of
+*			the interrupt.
+*			While a button is free the IIR follows the drift, so the change in
+*			its baseline per mV of sensor change is learned into tc_k (x256).
+*			While a button is pressed its baseline is frozen, so it is moved
+*			by tc_k times the temperature change instead, scaled by the share
+*			of the scans it was frozen for. That keeps long holds through a
+*			temperature swing from releasing or sticking.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+#ifdef USE_CS_TEMPCOMP
+void cap_TempComp(void)
+{
+	signed int dT, db, kobs, corr[2];
+	WORD base[2], hold[2], scans, temp;
+	BYTE i, reset;
+
+	GIE = 0;								// Take what the interrupt updates
+	tc_due = 0;
+	temp = TemperatureV;
+	reset = first;
+	scans = tc_scans;
+	tc_scans = 0;
+	for (i = 0; i < 2; i++)
+	{
+		base[i] = avg[i] >> 5;
+		hold[i] = tc_hold[i];
+		tc_hold[i] = 0;
+	}
+	GIE = 1;
+
+	dT = temp - tc_temp;
+
+	for (i = 0; i < 2; i++)
+	{
+		corr[i] = 0;
+		if (tc_temp == 0 || reset)
+		{
+			// No reference yet, just take one
+		}
+		else if (hold[i])
+		{
+			// Frozen baseline, pre-correct it for its share of the change
+			corr[i] = ((signed long)tc_k[i] * dT) >> 8;
+			if (hold[i] < scans) corr[i] = ((signed long)corr[i] * hold[i]) / scans;
+		}
+		else if (dT >= TC_MIN_DT || dT <= -TC_MIN_DT)
+		{
+			// Free baseline, learn how far it moved per mV
+			db = base[i] - tc_base[i];
+			if (db > TC_DB_MAX) db = TC_DB_MAX;
+			if (db < -TC_DB_MAX) db = -TC_DB_MAX;
+			kobs = (db << 8) / dT;
+			tc_k[i] += (kobs - tc_k[i]) >> TC_LEARN_SHIFT;
+			if (tc_k[i] > TC_K_MAX) tc_k[i] = TC_K_MAX;
+			if (tc_k[i] < -TC_K_MAX) tc_k[i] = -TC_K_MAX;
+		}
+		tc_base[i] = base[i] + corr[i];
+	}
+
+	GIE = 0;
+	avg[0] += corr[0] << 5;
+	avg[1] += corr[1] << 5;
+	GIE = 1;
+	tc_temp = temp;
+}
+#endif
+
+
+/******************************************************************************
+* Function: void cap_Arbitrate (void)
+*
+* Overview: Multi key arbitration on the deltas of the two pads. Runs after
+*			the threshold test and clears BTN1/BTN2 and sets reject for:
+*			- Palm or large object, either pad sees far more than a finger
+*			- Water film, both pads only just over the threshold, only with
+*			  calibrated thresholds as the defaults are not a finger's worth
+*			- Cross talk, one pad pressed but the other is over half way there
+*			A deliberate two finger touch gives about a finger's worth
+*			(2x threshold after calibration) on each pad and is kept.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+#ifdef USE_CS_ARBITRATION
+void cap_Arbitrate(void)
+{
+	reject = 0;
+
+	if (BTN1 && BTN2)
+	{
+		if (delta[0] > (thold[0] << CS_PALM_SHIFT) || delta[1] > (thold[1] << CS_PALM_SHIFT))
+			reject = 1;								// palm
+		else if (cs_calibrated && delta[0] < thold[0] + (thold[0] >> 1) && delta[1] < thold[1] + (thold[1] >> 1))
+			reject = 1;								// water film
+	}
+	else if (BTN1)
+	{
+		if (delta[1] > (thold[1] >> 1) && delta[0] < (delta[1] << 1)) reject = 1;	// cross talk
+	}
+	else if (BTN2)
+	{
+		if (delta[0] > (thold[0] >> 1) && delta[1] < (delta[0] << 1)) reject = 1;
+	}
+
+	if (reject)
+	{
+		BTN1 = 0;
+		BTN2 = 0;
+	}
+}
+#endif
+
+
+/******************************************************************************
+* Function: void cps_Start (BYTE channel)
+*
+* Overview: CPS backend. Selects the pad and starts a new count. Timer0 is
+*			clocked by the CPS oscillator, the count is read one tick later
+*			so the gate time is set by Timer1. Only called from the
+*			interrupt, Init starts the first count itself.
+*
+* Input:    BYTE channel - CPS channel of the pad
+*
+* Output:   None
+*
+******************************************************************************/
+#ifdef CS_BACKEND_CPS
+void cps_Start(BYTE channel)
+{
+	CPSCON1 = channel;
+	cps_ovf = 0;
+	TMR0 = 0;								// also clears the prescaler
+	TMR0IF = 0;
+	CPSON = 1;								// start the oscillator
+}
+
+
+/******************************************************************************
+* Function: WORD cps_Read (void)
+*
+* Overview: CPS backend. Stops the oscillator and returns the count. A
+*			finger adds capacitance and lowers the count, the same way it
+*			lowers a CVD reading, so the filtering and detection is shared.
+*			The oscillator rate depends on the pad and the supply, so the
+*			count is clamped to CPS_COUNT_MAX to keep raw<<5 in 16 bits.
+*
+* Input:    None
+*
+* Output:   Oscillator count over the gate time, up to CPS_COUNT_MAX
+*
+******************************************************************************/
+WORD cps_Read(void)
+{
+	CPSON = 0;								// freeze Timer0
+	if (TMR0IF)								// overflow not serviced yet
+	{
+		TMR0IF = 0;
+		cps_ovf++;
+	}
+	if (cps_ovf > (CPS_COUNT_MAX >> 8)) return CPS_COUNT_MAX;	// pad out of range
+	return (cps_ovf << 8) + TMR0;
+}
+#endif
+
+
+/******************************************************************************
+* Function: void ProxEnter (void)
+*
+* Overview: Asks the interrupt to swap the per button scan for the slow
+*			proximity scan. The swap happens after the key scan in progress.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+#ifdef USE_PROXIMITY
+void ProxEnter(void)
+{
+	ProxFirst=1;				// Preload the filters on the first scan
+	ProxTick=0;
+	ProxPhase=0;				// The key scan has just run its FVR session
+	ProxLeave=0;
+	BTN1=0;						// No keys while in proximity mode
+	BTN2=0;
+	ProxMode=1;
+}
+
+
+/******************************************************************************
+* Function: void ProxExit (void)
+*
+* Overview: Leaves the proximity scan and starts the key scan again with the
+*			first button. The key baselines from before the proximity scan
+*			are kept, ProxRestore() checks them against the first scan.
+*			Only called from the interrupt, on a hand detection or when
+*			PwrEnter() set ProxLeave.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void ProxExit(void)
+{
+	ProxMode = 0;
+	ProxLeave = 0;
+
+	while(GO_nDONE);					// Let a conversion finish
+	BTN1_out;							// charge ADC Chold
+	BTN1_high;
+	ADCON0   = ADC_BTN1;
+	GO_nDONE = 1;						// disconnect ADC Chold
+	BTN1_low;							// discharge sensor BTN 1
+	BTN1_in;							// disconnect output driver
+	GO_nDONE = 0;						// reconnect ADC Chold to sensor
+	GO_nDONE = 1;						// start conversion of value
+	CS_statevar = 0;
+	ProxResume = 1;						// Check the baselines on the first scan
+}
+
+
+/******************************************************************************
+* Function: void ProxRestore (void)
+*
+* Overview: Called from the interrupt on the first key scan after the
+*			proximity scan. The median ring is preset from the live reading,
+*			its samples are from before the proximity scan. The baseline of
+*			each button is checked against the live reading as in
+*			CapSenseRestore():
+*			- Within one threshold, or lower by up to a palm, the baseline
+*			  is kept, so the hand that woke the scan is seen as a press
+*			- Higher by more than a threshold or lower by more than a palm,
+*			  the pad drifted while the key scan was stopped, start again
+*			  from the live reading
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void ProxRestore(void)
+{
+	unsigned char i;
+	signed int diff;
+
+	for(i=0;i<2;i++)
+	{
+#ifdef USE_CS_MEDIAN
+		med_ring[i][0] = med_ring[i][1] = raw[i];
+#endif
+		diff=(avg[i] >> 5) - raw[i];		// positive when live reads touched
+		if(diff < -thold[i] || diff > (thold[i] << CS_PALM_SHIFT))
+		{
+			avg[i]=raw[i] << 5;
+		}
+	}
+	ProxResume=0;
+}
+
+
+/******************************************************************************
+* Function: void ProxScan (void)
+*
+* Overview: Proximity scan. Runs from the interrupt in place of cap_Sense()
+*			every PROX_SCAN_TICKS. The ADC can only connect one pad to Chold,
+*			so each pad is converted in turn. Both pads are discharged
+*			together and left floating, so the other pad sits at 0V next to
+*			the one converted (there is no active guard), and the two
+*			results are averaged as one large electrode. A fast filter (x2)
+*			is compared against a very slow baseline (x64). A drop over
+*			PROX_THRESHOLD restarts the key scan.
+*			FvrTick() runs on every call, in the same 2 tick phases as the
+*			key scan, so the battery and temperature are still read.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void ProxScan(void)
+{
+	WORD prox;
+
+	while(GO_nDONE);					// Let a key scan conversion finish
+	FvrTick(ProxPhase);					// Battery and temperature as in the key scan
+	ProxPhase ^= 1;
+
+	if(ProxTick > 0)
+	{
+		ProxTick--;
+		return;
+	}
+	ProxTick=PROX_SCAN_TICKS-1;
+
+	// Pad 1, pad 2 discharged beside it
+	BTN1_out; BTN2_out;					// charge ADC Chold
+	BTN1_high; BTN2_high;
+	ADCON0   = ADC_BTN1;
+	GO_nDONE = 1;						// disconnect ADC Chold
+	BTN1_low; BTN2_low;					// discharge both pads
+	BTN1_in; BTN2_in;					// disconnect output drivers
+	GO_nDONE = 0;						// reconnect ADC Chold to sensor
+	GO_nDONE = 1;						// start conversion of value
+	while(GO_nDONE);
+	prox = ADRES;
+
+	// Pad 2, pad 1 discharged beside it
+	BTN1_out; BTN2_out;
+	BTN1_high; BTN2_high;
+	ADCON0   = ADC_BTN2;
+	GO_nDONE = 1;
+	BTN1_low; BTN2_low;
+	BTN1_in; BTN2_in;
+	GO_nDONE = 0;
+	GO_nDONE = 1;
+	while(GO_nDONE);
+	prox = (prox + ADRES) >> 1;			// one electrode, 10 bit range
+
+	BTN1_out; BTN2_out;					// leave the pads discharged
+	
+	if(ProxFirst)
+	{
+		ProxAvg = prox << 6;
+		ProxFilt = prox << 1;
+		ProxFirst = 0;
+		return;
+	}
+
+	ProxFilt = ProxFilt - (ProxFilt >> 1) + prox;
+
+	if((signed int)((ProxAvg >> 6) - (ProxFilt >> 1)) > PROX_THRESHOLD)
+	{
+		//**** Hand detected, restart the key scan with the first button ****
+		ProxExit();
+		ProxWake = 1;
+		return;
+	}
+
+	ProxAvg = ProxAvg - (ProxAvg >> 6) + prox;	// only track when no hand
+}
+#endif
+
+
+/******************************************************************************
+* Function: WORD Median3 (WORD *s, WORD x)
+*
+* Overview: Returns the median of the new sample and the 2 before it,
+*			then moves the new sample into the ring. Worst case is 3
+*			compares, no sorting.
+*
+* Input:    WORD *s - Pointer to the 2 previous samples, newest first
+*			WORD x - New sample
+*
+* Output:   The middle value
+*
+******************************************************************************/
+#ifdef USE_CS_MEDIAN
+WORD Median3(WORD *s, WORD x)
+{
+	WORD a = s[0], b = s[1], c = x;
+
+	s[1] = a;							// keep the newest 2
+	s[0] = x;
+	if (a > b)
+	{
+		if (b > c) return b;			// a > b > c
+		return (a > c) ? c : a;			// b is smallest
+	}
+	if (a > c) return a;				// c < a <= b
+	return (b > c) ? c : b;				// a is smallest
+}
+#endif
+
+
+/******************************************************************************
+* Function: void IncTime (void)
+*
+* Overview: This function increments the time by 1 second and
+*			updates minutes and hours as required.
+*			Time is stored in 24 hour format and AM/PM handled elseware
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void IncTime(void)
+{
+	Sec++;
+	if(Sec >59)				// Check for Seconds -> Minutes overflow
+	{
+		Sec=0;
+		Min++;
+		if(Min >59)			// Check for Minutes -> Hours Overflow
+		{
+			Min=0;
+			Hrs++;
+			if(Hrs > 23)	// Check for Hours -> Day Overflow
+			{
+				Hrs = 0;
+			}
+
+		}
+	}
+	TimeCalc();
+}
+
+
+/******************************************************************************
+* Function: void TimeCalc (void)
+*
+* Overview: This function creates the 16 bit Hrs/Minutes display values
+*			Time24 and Time from Hrs and Min without advancing the clock
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void TimeCalc(void)
+{
+	//**** Create the 16 bit Hrs/Minutes ****
+	Time24=Hrs*100;
+	Time24+=Min;
+	Time=Time24;
+	if(AMPM==0)						// Check for 12Hr format, and convert down
+	{
+		if(Time > 1299) Time-=1200;	// Convert to 12 Hour for PM
+		if(Time <	99) Time+=1200; // Create Midnight for AM
+	}
+}
+
+
+/******************************************************************************
+* Function: void ShowNumber (void)
+*
+* Overview: This displays a number on the screen
+*			Positive values only 0 to 9999
+*			Selectable decimal point
+*			Leading or no Leading zeros
+*
+* Input:    unsigned int num  - Value between 0 and 9999
+*
+*			char db - location of decimal point 0=none, 1=left, 2=center, 4=right
+*					- Can add together to get a combination of locations
+*					- add 0x80 to remove leading zeros
+* Output:   None
+*
+******************************************************************************/
+void ShowNumber(unsigned int num, char dp)
+{
+	unsigned int temp;
+	unsigned char lead=0;
+
+	if(dp & 0x80)lead=1;	// If set remove leading zeros
+
+	if(num > 9999) 			// If greater than 9999 then we have an Error
+	{
+		// Display Err
+		lcd_putc(CHAR_E,3,0);
+		lcd_putc(CHAR_r,2,0);
+		lcd_putc(CHAR_r,1,0);
+		lcd_putc(CHAR_SPACE,0,0);
+		return;
+	}
+
+	temp=num/1000;							// Thousands digit
+	if(lead==1 && temp==0 && (dp&1)==0)
+	{
+		lcd_putc(CHAR_SPACE, 3,0);
+	}
+	else
+	{
+		lcd_putc(temp, 3,dp&1);
+		lead=0;
+	}
+	num-=(temp*1000);
+
+	temp=num/100;							// Hundreds Digit
+	dp=dp>>1;
+	if(lead==1 && temp==0 && (dp&1)==0)
+	{
+		lcd_putc(CHAR_SPACE, 2,0);
+	}
+	else
+	{
+		lead=0;
+		lcd_putc(temp, 2,dp&1);
+	}
+	num-=(temp*100);
+
+	temp=num/10;							// Tens Digit
+	dp=dp>>1;
+	if(lead==1 && temp==0 && (dp&1)==0)
+	{
+		lcd_putc(CHAR_SPACE, 1,0);
+	}
+	else
+	{
+		lead=0;
+		lcd_putc(temp,1,dp&1);
+	}
+	num-=(temp*10);
+
+	// Dont check for lead - always print he last zero.
+	lcd_putc(num,0,0);						// Ones Digit
+}	
+
+/******************************************************************************
+* Function: void BatteryDisplay (unsigned char page)
+*
+* Overview: This function updates the battery status symbols
+*			And displays the Battery voltage on the screen
+*			or with USE_BAT_GAUGE the estimated days remaining.
+*			The low battery alert is done by BatteryManager, without
+*			USE_BAT_MANAGER it beeps here once each time the page shows.
+*
+* Input:    page - 0 voltage, 1 days remaining
+*
+* Output:   None
+*
+******************************************************************************/
+void BatteryDisplay(unsigned char page)
+{
+	// Update Segments
+	SEG_COLON=0;
+	BatteryBars();
+
+#ifdef USE_BAT_GAUGE
+	if(page == 1)
+	{
+		if(GaugeDays == 0xFFFF)				// No estimate yet
+		{
+			lcd_putc(CHAR_MINUS,3,0);
+			lcd_putc(CHAR_MINUS,2,0);
+			lcd_putc(CHAR_MINUS,1,0);
+			lcd_putc(CHAR_MINUS,0,0);
+		}
+		else
+		{
+			ShowNumber(GaugeDays,0x80);		// Print the days remove leading zeros
+		}
+		lcd_putc(CHAR_d,4,0); 				// Display a "d" in the top right corner
+		return;
+	}
+#endif
+
+#ifndef USE_BAT_MANAGER
+	if(BatteryV < BAT_LEVEL_MIN && BatBeepSec != Sec)	// Alert user to Low Battery
+	{
+		BatBeepSec=Sec;
+		SoundPlay(SndBeep);
+	}
+#endif
+
+	// Display Voltage on the display
+	ShowNumber(BatteryV,1);					// Print the voltage
+		
+	lcd_putc(CHAR_b,4,0); 					// Display a "b" in the top right corner
+}
+
+
+/******************************************************************************
+* Function: void LcdAdapt (void)
+*
+* Overview: Picks the lowest LCD ladder power that keeps the contrast, once
+*			a second. The battery gives step 0 above BAT_LEVEL_MED, 1 above
+*			BAT_LEVEL_MIN and 2 below, with BAT_HYST either side of a level.
+*			Below LCD_COLD_MV the glass is slow and gets one step more.
+*			The frame rate comes from PwrPolicy, no faster than
+*			LCD_RATE_COLD on cold glass. It is set before the first
+*			battery reading, the ladder step waits for it.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+#ifdef USE_LCD_ADAPT
+void LcdAdapt(void)
+{
+	unsigned char step;
+
+	if(TemperatureV != 0)
+	{
+		if(TemperatureV < LCD_COLD_MV) LcdCold=1;
+		else if(TemperatureV > LCD_COLD_MV + LCD_COLD_HYST) LcdCold=0;
+	}
+
+	step=PwrPolicy[PwrState].lcd_rate;		// Frame rate does not need the battery
+	if(LcdCold && step < LCD_RATE_COLD) step=LCD_RATE_COLD;
+	if(step != LcdRate)
+	{
+		LcdRate=step;
+		lcd_rate(LcdRateLp[step]);
+	}
+
+	if(BatteryQ3 == 0) return;				// No battery reading yet
+
+	if(LcdBatStep < 2 && BatteryV < LcdLevel[LcdBatStep] - BAT_HYST) LcdBatStep++;
+	else if(LcdBatStep > 0 && BatteryV > LcdLevel[LcdBatStep-1] + BAT_HYST) LcdBatStep--;
+
+	step=LcdBatStep+LcdCold;
+	if(step != LcdStep)
+	{
+		LcdStep=step;
+		lcd_ladder(LcdStepRl[step],LcdStepCst[step]);
+	}
+}
+
+
+/******************************************************************************
+* Function: void LcdDisplay (void)
+*
+* Overview: Shows the ladder settings in use as 4 digits with an 'L' in the
+*			top right corner. Type-A power, Type-B power (0 off, 1 low,
+*			2 medium, 3 high), Type-A interval and the contrast step.
+*			With USE_BAT_GAUGE a second SET press shows the measured main
+*			loop awake time per pass in us ('A'), a third the charge per
+*			pass in nA*s ('n') for the CLK_STRATEGY built in.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void LcdDisplay(void)
+{
+	unsigned char rl;
+
+	SEG_COLON=0;
+	BatteryBars();
+#ifdef USE_BAT_GAUGE
+	if(LcdDiagPage)
+	{
+		ShowNumber((LcdDiagPage == 1) ? ClkWakeUs : ClkWakeNc,0x80);
+		lcd_putc((LcdDiagPage == 1) ? CHAR_A : CHAR_n,4,0);
+		return;
+	}
+#endif
+	rl=LcdStepRl[LcdStep];
+	ShowNumber((rl>>6)*1000 + ((rl>>4)&3)*100 + (rl&7)*10 + (LcdStepCst[LcdStep]&7),0);
+	lcd_putc(CHAR_L,4,0);
+}
+#endif
+
+
+/******************************************************************************
+* Function: unsigned char BatPercent (void)
+*
+* Overview: Charge left in percent from the filtered BatteryV using the
+*			discharge curve of an alkaline AAAA cell at clock currents.
+*			Linear between the points of BatCurveMv/BatCurvePct.
+*
+* Input:    None
+*
+* Output:   0 to 100
+*
+******************************************************************************/
+#ifdef USE_BAT_GAUGE
+unsigned char BatPercent(void)
+{
+	unsigned char i;
+
+	if(BatteryV <= BatCurveMv[0]) return 0;
+	for(i=1;i<sizeof(BatCurvePct);i++)
+	{
+		if(BatteryV < BatCurveMv[i])
+		{
+			return BatCurvePct[i-1] + ((unsigned long)(BatteryV - BatCurveMv[i-1]) *
+					(BatCurvePct[i] - BatCurvePct[i-1])) / (BatCurveMv[i] - BatCurveMv[i-1]);
+		}
+	}
+	return 100;
+}
+
+
+/******************************************************************************
+* Function: void GaugeUpdate (void)
+*
+* Overview: Called once a second. The awake, FVR and PWM times and the
+*			conversions counted in the second are turned into charge with
+*			the GAUGE_xxx_UA currents and added to GaugeQ, every
+*			GAUGE_PERIOD seconds that is averaged over the period. The
+*			measured main loop awake time per pass is kept in ClkWakeUs
+*			and the charge per pass from it in ClkWakeNc, both shown on
+*			the SET diagnostic pages to compare the CLK_STRATEGY builds.
+*			The average current is filtered (1/4) into GaugeUAQ2 and
+*			GaugeDays = charge left (BatPercent of BAT_CAPACITY_MAH) / current.
+*			The currents are estimates for this board, adjust them from a
+*			measured unit.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void GaugeUpdate(void)
+{
+	unsigned long awake,uas;
+	unsigned int fvr,pwm,adc;
+
+	// Main loop charge this second in uA x TMR1 counts, at most 32768 x GAUGE_HF_UA
+	awake =(unsigned long)ClkAwake[CLK_LOW] * GAUGE_LF_UA;
+	awake+=(unsigned long)ClkAwake[CLK_MID] * GAUGE_AWAKE_UA;
+	awake+=(unsigned long)ClkAwake[CLK_FAST] * GAUGE_HF_UA;
+	if(WakeCount)
+	{
+		ClkWakeNc=((awake >> 5) / WakeCount * 125) >> 7;	// x1000/32768
+		uas=((unsigned long)ClkAwake[CLK_LOW] + ClkAwake[CLK_MID] + ClkAwake[CLK_FAST]) / WakeCount;
+		uas=(uas * 15625) >> 9;				// x1000000/32768
+		ClkWakeUs=(uas > 9999) ? 9999 : uas;
+	}
+	ClkAwake[CLK_LOW]=ClkAwake[CLK_MID]=ClkAwake[CLK_FAST]=0;
+	WakeCount=0;
+
+	GIE=0;									// FVR and ADC counts change in the interrupt
+	fvr=GaugeFvr; pwm=GaugePwm; adc=GaugeAdc;
+	GaugeFvr=GaugePwm=GaugeAdc=0;
+	GIE=1;
+
+	// uA x TMR1 counts >> 7 is uA*s x256, under 2^32 for the period
+	GaugeQ+=awake >> 7;
+	GaugeQ+=((unsigned long)fvr * GAUGE_FVR_UA) >> 7;
+	GaugeQ+=((unsigned long)pwm * GAUGE_PWM_UA) >> 7;
+	GaugeQ+=((unsigned long)adc * GAUGE_ADC_UAS << 8) / 1000;	// GAUGE_ADC_UAS is nA*s per conversion
+
+	if(++GaugeSec < GAUGE_PERIOD) return;
+	GaugeSec=0;
+
+	uas=GAUGE_SLEEP_UA + GaugeQ / (256UL * GAUGE_PERIOD);	// Average in uA
+	GaugeQ=0;
+	if(uas > 0x3FFF) uas=0x3FFF;			// x4 fits a WORD
+
+	if(GaugeUAQ2 == 0) GaugeUAQ2=uas << 2;
+	else GaugeUAQ2+=uas - (GaugeUAQ2 >> 2);
+
+	if(BatteryQ3 == 0) return;				// No battery reading yet
+	// uAh left / uA = hours, /24 for days
+	uas=((unsigned long)BatPercent() * BAT_CAPACITY_MAH * 10 * 4) / GaugeUAQ2 / 24;
+	if(uas > 9999) uas=9999;
+	GaugeDays=uas;
+}
+#endif
+
+/******************************************************************************
+* Function: void TemperatureDisplay (void)
+*
+* Overview: This displays the temperature on the screen
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void TemperatureDisplay (void)
+{
+	TemperatureShow(TemperatureQ3,CHAR_t,0);
+}
+
+
+/******************************************************************************
+* Function: void TemperatureShow (unsigned int q3, unsigned char corner,
+*									unsigned char rel)
+*
+* Overview: Displays a sensor reading as a temperature in C or F
+*
+* Input:    q3 - sensor mV x8
+*			corner - character for the top right corner
+*			rel - 1 for a change in temperature, T_OFFSET_ZERO + change
+*				  in q3, shown without the 32F offset
+*
+* Output:   None
+*
+******************************************************************************/
+void TemperatureShow(unsigned int q3, unsigned char corner, unsigned char rel)
+{	
+	unsigned int result, minus_flag;
+	signed int tenths;
+	SEG_COLON=0;
+	
+
+	result = q3;					// mV x8
+	minus_flag = 0;
+	if (result < (T_OFFSET_ZERO<<3)){
+		result = (T_OFFSET_ZERO<<3) - result;
+		minus_flag = 1;
+	} else 
+		result -= (T_OFFSET_ZERO<<3);	// Shift by the 0 degree offset (400mV for MCP9701)
+	// Tenths of a degree = mV*100/T_DIVISOR = (mV x8)*25/(T_DIVISOR*2)
+	// 19.5mV/degree (195)for MCP9701 which scales down at the same time
+	tenths = ((unsigned long)result * 25) / (T_DIVISOR * 2);
+	if(minus_flag) tenths = -tenths;
+
+	if(DEGCF==1)
+	{
+		// Calculate Farenheight
+		tenths=(9*tenths)/5;		// Tf = (9/5)*Tc+32 in tenths
+		if(rel == 0) tenths+=320;
+	}
+	minus_flag = 0;
+	if(tenths < 0)
+	{
+		tenths = -tenths;
+		minus_flag = 1;
+	}
+	result = tenths;
+
+#ifdef USE_ADC_OVERSAMPLE
+	// 0.1 degree fits in 3 digits up to 99.9, or 9.9 with the minus sign
+	if(result < 1000 && (minus_flag == 0 || result < 100))
+	{
+		ShowNumber(result*10,0x82);	// Shift for the c or f, point after the units
+	}
+	else
+#endif
+	{
+		result = (result/10)*10;	// Whole degrees
+		ShowNumber(result,0x80);	// Display temperature remove leading zeros
+	}
+
+	if(DEGCF==1)
+	{
+		lcd_putc(CHAR_F,0,0);		// Add the 'F'
+	}
+	else
+	{
+		lcd_putc(CHAR_c,0,0);		// Add the 'c'
+	}
+	
+	lcd_putc(corner,4,0); 			// Top right corner, a "t" for the current Temperature
+	if(minus_flag) lcd_putc(CHAR_MINUS,3,0);
+
+	BatteryBars();
+}
+
+
+/******************************************************************************
+* Function: void BatteryBars (void)
+*
+* Overview: Updates the battery outline and bars from BatteryV.
+*			A bar is only added BAT_HYST above its level and only removed
+*			BAT_HYST below it, so a reading close to a level does not flicker.
+*			No bars indicates battery is below BAT_LEVEL_MIN and should be replaced
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void BatteryBars(void)
+{
+	while(BatBars < 3 && BatteryV > BatLevel[BatBars] + BAT_HYST) BatBars++;
+	while(BatBars > 0 && BatteryV < BatLevel[BatBars-1] - BAT_HYST) BatBars--;
+
+	SEG_BAT1=1;								// Battery Outline always displayed
+#ifdef USE_BAT_MANAGER
+	if(BatState == BAT_CRITICAL && (Sec & 1)) SEG_BAT1=0;	// Flashes when critical
+#endif
+	SEG_BAT2=(BatBars > 0);					// One Bar
+	SEG_BAT3=(BatBars > 1);					// Two Bars
+	SEG_BAT4=(BatBars > 2);					// Three Bars
+}
+
+
+/******************************************************************************
+* Function: void BatteryManager (void)
+*
+* Overview: Battery state machine run once a second from the filtered BatteryV.
+*			Each state is left BAT_HYST_STATE above the level it was entered at
+*			so a battery close to a level does not toggle between states.
+*			With USE_BAT_RES the voltage is first lowered by BatDropQ2, the
+*			drop measured under the piezo load, so a worn cell with a good
+*			open circuit voltage is reported days earlier.
+*			Low      - Alert once on entry and then every BAT_ALERT_LOW seconds
+*			Critical - Alert every BAT_ALERT_CRIT seconds and the battery
+*					   outline flashes. PwrUpdate() moves to PWR_CRITICAL.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+#ifdef USE_BAT_MANAGER
+void BatteryManager(void)
+{
+	unsigned int v;
+
+	if(BatteryQ3 == 0) return;				// No battery reading yet
+
+	v=BatteryV;
+#ifdef USE_BAT_RES
+	if(v > (BatDropQ2 >> 2)) v-=BatDropQ2 >> 2;	// Judge the cell by its voltage under load
+	else v=0;
+#endif
+
+	switch(BatState)
+	{
+		case BAT_GOOD:
+			if(v < BAT_LEVEL_LOW)
+			{
+				BatState=BAT_LOW;
+				BatAlertSec=0;				// Alert now
+			}
+			break;
+
+		case BAT_LOW:
+			if(v > BAT_LEVEL_LOW + BAT_HYST_STATE)BatState=BAT_GOOD;
+			else if(v < BAT_LEVEL_CRITICAL)
+			{
+				BatState=BAT_CRITICAL;
+				BatAlertSec=0;
+			}
+			break;
+
+		case BAT_CRITICAL:
+			if(v > BAT_LEVEL_CRITICAL + BAT_HYST_STATE)BatState=BAT_LOW;
+			break;
+
+		default:
+			BatState=BAT_GOOD;
+	}
+
+	if(BatState == BAT_GOOD) return;
+	if(BatAlertSec > 0)
+	{
+		BatAlertSec--;
+		return;
+	}
+	SoundPlay(SndBeep);						// Alert user to Low Battery
+	if(BatState == BAT_CRITICAL) BatAlertSec=BAT_ALERT_CRIT;
+	else BatAlertSec=BAT_ALERT_LOW;
+}
+#endif
+
+
+/******************************************************************************
+* Function: unsigned char ScanDue (void)
+*
+* Overview: Called every tick from the interrupt, returns 1 when the cap sense
+*			should run, every ScanDiv ticks as set by the power state.
+*			The CPS gate is restarted on the last skipped tick so the count
+*			is still over one tick.
+*
+* Input:    None
+*
+* Output:   1 to run the cap sense this tick
+*
+******************************************************************************/
+unsigned char ScanDue(void)
+{
+	if(ScanSkip == 0)
+	{
+		ScanSkip=ScanDiv-1;
+		return 1;
+	}
+	ScanSkip--;
+#ifdef CS_BACKEND_CPS
+	if(ScanSkip == 0) cps_Start(CS_statevar == 0 ? CPS_CH_BTN1 : CPS_CH_BTN2);
+	else CPSON=0;							// Oscillator off while skipping
+#endif
+	return 0;
+}
+
+
+/******************************************************************************
+* Function: void PwrSecond (void)
+*
+* Overview: Called once a second. Counts the time in the current state and
+*			the total minutes per state, then checks for a state change.
+*			A total stops at 0xFFFF minutes (45 days).
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void PwrSecond(void)
+{
+	if(++PwrTimeSec >= 60)
+	{
+		PwrTimeSec=0;
+		if(PwrTime[PwrState] < 0xFFFF) PwrTime[PwrState]++;
+	}
+	if(PwrStateSec < 0xFFFF) PwrStateSec++;
+	PwrUpdate();
+}
+
+
+/******************************************************************************
+* Function: void PwrUpdate (void)
+*
+* Overview: Works out the power state and enters it if it has changed.
+*			Critical - battery manager in BAT_CRITICAL and no alarm ringing
+*			Active   - in Setup, alarm ringing or a key in the last PWR_IDLE_S
+*			Dark     - no key for PWR_DARK_S, or for PWR_STANDBY_S in the
+*					   display off window (USE_LCD_STANDBY), not in Setup
+*			Standby  - no key for PWR_STANDBY_S, or for PWR_IDLE_S at night
+*			Idle     - otherwise
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void PwrUpdate(void)
+{
+	unsigned char state;
+
+	if(SetupState || IdleSeconds < PWR_IDLE_S) state=PWR_ACTIVE;
+	else if(IdleSeconds >= PWR_STANDBY_S || Hrs >= PWR_NIGHT_START || Hrs < PWR_NIGHT_END) state=PWR_STANDBY;
+	else state=PWR_IDLE;
+#ifdef USE_LCD_STANDBY
+	if(SetupState == 0)						// Never blank a Setup edit
+	{
+		if(IdleSeconds >= PWR_DARK_S) state=PWR_DARK;
+		else if(IdleSeconds >= PWR_STANDBY_S && Hrs >= PWR_DARK_START && Hrs < PWR_DARK_END) state=PWR_DARK;
+	}
+#endif
+#ifdef USE_BAT_MANAGER
+	if(BatState == BAT_CRITICAL) state=PWR_CRITICAL;
+#endif
+#ifdef USE_ALARM
+	if(AlarmRing) state=PWR_ACTIVE;			// Full key scan for snooze and off
+#endif
+
+	if(state != PwrState) PwrEnter(state);
+}
+
+
+/******************************************************************************
+* Function: void PwrEnter (unsigned char state)
+*
+* Overview: Enters a power state and applies its PwrPolicy entry. The scan
+*			rate, the proximity scan and the display standby are set here,
+*			the other subsystems check the flags of the current state when
+*			they run.
+*
+* Input:    unsigned char state  -  PWR_xxx
+*
+* Output:   None
+*
+******************************************************************************/
+void PwrEnter(unsigned char state)
+{
+	unsigned char lcd;
+
+	lcd=(PwrPolicy[state].flags ^ PwrPolicy[PwrState].flags) & PWR_F_LCD;
+	if(lcd && (PwrPolicy[state].flags & PWR_F_LCD)) lcd_wake();	// Back with the saved frame
+	else if(lcd) lcd_standby();
+
+	PwrState=state;
+	PwrStateSec=0;
+	ScanDiv=PwrPolicy[state].scan_div;
+#ifdef USE_CS_TEMPCOMP
+	if(!(PwrPolicy[state].flags & PWR_F_TEMP)) tc_temp=0;	// The next sample only takes a reference
+#endif
+#ifdef USE_PROXIMITY
+	if(PwrPolicy[state].flags & PWR_F_PROX)
+	{
+		GIE=0;							// The interrupt may be leaving it
+		if(ProxMode == 0) ProxEnter();
+		else ProxLeave=0;				// Still in it, stay
+		GIE=1;
+	}
+	else if(ProxMode)
+	{
+		ProxLeave=1;					// The interrupt swaps back to the key scan
+	}
+#endif
+}
+
+
+/******************************************************************************
+* Function: void TimeDisplay (void)
+*
+* Overview: This function displays the time in the appropiate format
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void TimeDisplay(void)
+{
+	unsigned char Temp;
+	
+	if(AMPM==0)
+	{
+		// 12 Hour format 
+		ShowNumber(Time, 0x80);				// Display 12Hr Time with no leading zeros
+		if(Hrs > 11)lcd_putc(CHAR_P,4,0);	// Display an A or P in the top right corner
+		else lcd_putc(CHAR_A,4,0);
+	}
+	else
+	{
+		// 24 Hour format 
+		ShowNumber(Time24, 0);				// Display 24 Hour time
+	}
+#ifdef USE_CHECKPOINT
+	if(TimeApprox && (Sec & 1)) lcd_putc(CHAR_MINUS,4,0);	// Blinks until the time is set
+	else
+#endif
+    lcd_putc(CHAR_SPACE,4,0);
+}
+
+
+/******************************************************************************
+* Function: void Setup (unsigned char key)
+*
+* Overview: This function lets user set up time and other things
+*			SET steps the value, holding it auto repeats. MODE moves on.
+*
+* Input:    unsigned char key - Key event from KeyGet(), 0 if none
+*
+* Output:   None
+*
+******************************************************************************/
+#define BLINK_CHECK 4  // Times through before blinking display
+void Setup(unsigned char key)
+{
+	static char Blink=0;
+	unsigned char blank,step,press,next;
+#ifdef USE_ALARM
+	unsigned char alarm=0;
+#endif
+	
+	if(SetupState < 4)
+	{
+		TimeDisplay();  		// Display for Time based settings
+	}
+	else if (SetupState < 5)
+	{	
+		TemperatureDisplay();	//  Display for Temperature settings
+		SEG_COLON=0;			// Remove the auto Colon 
+	}
+	#ifdef USE_ALARM
+	else if (SetupState <= SETUP_ALARM_LAST)
+	{
+		alarm=(SetupState-5)/3;	// 3 states per alarm
+		AlarmDisplay(alarm); 	// Display for Alarm based settings
+	}
+	#endif
+	
+	
+	blank=0;
+	Blink++;
+	if(Blink >= BLINK_CHECK)
+	{
+		Blink=0;
+		blank=1;				// Blank the field being set this pass
+	}
+
+	press=(key == (KEY_EV_PRESS|KEY_SET));				// SET tapped
+	step=(press || key == (KEY_EV_LONG|KEY_SET) || key == (KEY_EV_REPEAT|KEY_SET)); // SET tapped or held
+	next=(key == (KEY_EV_PRESS|KEY_MODE));				// MODE tapped
+	
+	switch(SetupState)
+	{
+		case 1: // Set Hours
+			if(blank)
+			{
+				lcd_putc(CHAR_SPACE,3,0);
+				lcd_putc(CHAR_SPACE,2,0);
+			}
+			
+			if (step)
+			{
+				Hrs++;
+				if(Hrs > 23)Hrs=0;
+				Sec=0; // Clear seconds only when changing the time
+#ifdef USE_CHECKPOINT
+				TimeApprox=0;
+#endif
+			}
+			else if(next)
+			{
+				SetupState++;
+			}
+			
+			break;
+
+		case 2: // Set Minutes
+			if(blank)
+			{
+				lcd_putc(CHAR_SPACE,1,0);
+				lcd_putc(CHAR_SPACE,0,0);
+			}
+			
+			if (step)
+			{
+				Min++;
+				if(Min > 59)Min=0;
+				Sec=0;				// Clear seconds only when changing the time
+#ifdef USE_CHECKPOINT
+				TimeApprox=0;
+#endif
+			}
+			else if(next)
+			{
+				SetupState++;
+			}
+			break;
+
+
+		case 3:	// Change AM/PM/24
+			if(blank) lcd_putc(CHAR_SPACE,4,0);
+			if (press)
+			{
+				if(AMPM==0)
+				{
+					if(Hrs < 12)Hrs+=12;	// Move to PM
+					else AMPM=1;			// Change to 24Hr Format
+				}
+				else
+				{
+					if(Hrs > 11)Hrs-=12; 	// Move to AM
+					AMPM=0;
+				}
+
+
+			}
+			else if(next)
+			{
+				SetupState++; 	
+			}
+			break;
+
+		case 4: // C or F 
+			if(blank) lcd_putc(CHAR_SPACE,0,0);		 // blank C/F character
+			if (press)
+			{
+				if(DEGCF==0) DEGCF=1;
+				else DEGCF=0;
+
+			}
+			else if(next)
+			{
+				SetupState++; 				// Move to Next state
+			}
+			break;
+			
+// Following options are for the ALARM setting #define USE_ALARM in main.h
+// 3 states for each of the ALARM_COUNT alarms, F1 or F2 shows which
+#ifdef USE_ALARM
+		default:
+			if(SetupState > SETUP_ALARM_LAST)
+			{
+				SetupExit(1); 	  // Exit
+				break;
+			}
+
+			switch((SetupState-5)%3)
+			{
+				case 0: // Set Alarm Hours
+					if(blank)
+					{
+						lcd_putc(CHAR_SPACE,3,0);
+						lcd_putc(CHAR_SPACE,2,0);
+					}
+			
+					if (step)
+					{
+						AlarmHrs[alarm]++;
+						if(AlarmHrs[alarm] > 23)AlarmHrs[alarm]=0;
+					}
+					break;
+
+				case 1: // Set Alarm Minutes
+					if(blank)
+					{
+						lcd_putc(CHAR_SPACE,1,0);
+						lcd_putc(CHAR_SPACE,0,0);
+					}
+			
+					if (step)
+					{
+						AlarmMin[alarm]++;
+						if(AlarmMin[alarm] > 59)AlarmMin[alarm]=0;
+					}
+					break;
+
+				default: // Turn On or Off
+					if(blank) lcd_putc(CHAR_SPACE,4,0);
+		
+					if (press)
+					{
+						AlarmOn ^= (1<<alarm);
+					}
+					if(blank && (AlarmOn & (1<<alarm)) && (PwrPolicy[PwrState].flags & PWR_F_SOUND))SoundPlay(SndClick);
+					break;
+			}
+
+			if(next)
+			{
+				SetupState++;
+			}
+			break;
+#else
+
+		default: 
+			SetupExit(1); 	  // Exit
+#endif
+		
+
+
+	} // END: switch(SetupState)
+
+	TimeCalc();   	// Updates the display values if anything was changed
+#ifdef USE_ALARM
+	if(step || press) AlarmSchedule();	// Time or an alarm changed
+#endif
+}
+
+
+/******************************************************************************
+* Function: void SetupExit (unsigned char confirm)
+*
+* Overview: Every way out of Setup comes here. F1/F2 go back to the enabled
+*			alarms and, when asked, the chime confirms the new settings.
+*
+* Input:    confirm - 1 chimes if an alarm is on, 0 for a forced exit
+*
+* Output:   None
+*
+******************************************************************************/
+void SetupExit(unsigned char confirm)
+{
+	SetupState=0;
+#ifdef USE_ALARM
+	AlarmSchedule();					// Back to the enabled alarms on F1/F2
+	if(confirm && AlarmOn && (PwrPolicy[PwrState].flags & PWR_F_SOUND))SoundPlay(SndChime);	// Confirm the new settings
+#endif
+}
+
+
+
+/******************************************************************************
+* Function: void AlarmCheck (void)
+*
+* Overview: Runs every main loop pass while an alarm is ringing, otherwise
+*			it returns straight away. Keeps the alarm patterns going, quiet
+*			for the first ALARM_SOFT_S seconds and then louder.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+#ifdef USE_ALARM
+void AlarmCheck(void)
+{
+	if(AlarmRing == 0) return;				// Nothing to do
+
+	if(SoundBusy() == 0)					// Next once the last has finished
+	{
+		if(AlarmRingSec < ALARM_SOFT_S)SoundPlay(SndAlarmSoft);
+		else SoundPlay(SndAlarm);
+	}
+}
+
+
+/******************************************************************************
+* Function: void AlarmSecond (void)
+*
+* Overview: Called once a second after IncTime. On the minute rollover the
+*			time is compared with AlarmNext, the one precomputed fire time,
+*			and the schedule is worked out again. A ringing alarm is
+*			silenced after ALARM_SILENCE_S seconds.
+*			On a critical battery only alarm 1 rings.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void AlarmSecond(void)
+{
+	unsigned char a;
+
+	if(AlarmRing)
+	{
+		if(++AlarmRingSec >= ALARM_SILENCE_S) AlarmStop(0);	// Auto silence
+	}
+
+	if(Sec != 0) return;					// Only on the minute rollover
+
+	if(AlarmNext == (unsigned int)Hrs*60 + Min)
+	{
+		a=AlarmNextIdx & ~ALARM_SNOOZED;
+		if(AlarmNextIdx & ALARM_SNOOZED) SnoozeAt=0xFFFF;	// Snooze used up
+		if(a == 0 || PwrState != PWR_CRITICAL)	// Only alarm 1 on a critical battery
+		{
+			AlarmRing=a+1;
+			AlarmRingSec=0;
+		}
+	}
+	AlarmSchedule();
+}
+
+
+/******************************************************************************
+* Function: void AlarmSchedule (void)
+*
+* Overview: Works out AlarmNext, the first enabled alarm or snooze after the
+*			current minute, so the check each minute is a single compare.
+*			Called on the minute rollover and whenever the time, an alarm
+*			or the snooze changes. Also shows the enabled alarms on F1/F2.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void AlarmSchedule(void)
+{
+	unsigned int now,t,wait,best;
+	unsigned char a;
+
+	now=(unsigned int)Hrs*60 + Min;
+	best=0xFFFF;
+	AlarmNext=0xFFFF;						// None
+
+	for(a=0;a<=ALARM_COUNT;a++)
+	{
+		if(a < ALARM_COUNT)
+		{
+			if((AlarmOn & (1<<a)) == 0) continue;
+			t=(unsigned int)AlarmHrs[a]*60 + AlarmMin[a];
+		}
+		else								// Snooze is checked last
+		{
+			if(SnoozeAt == 0xFFFF) continue;
+			t=SnoozeAt;
+		}
+		wait=(t + MINS_PER_DAY - now) % MINS_PER_DAY;
+		if(wait == 0) wait=MINS_PER_DAY;	// This minute has gone, tomorrow
+		if(wait < best)
+		{
+			best=wait;
+			AlarmNext=t;
+			AlarmNextIdx=(a < ALARM_COUNT) ? a : (SnoozeIdx | ALARM_SNOOZED);
+		}
+	}
+
+	if(SetupState == 0)						// Setup uses them to show the alarm edited
+	{
+		SEG_F1=(AlarmOn & 0x01) ? 1 : 0;	// Alarm 1 enabled
+		SEG_F2=(AlarmOn & 0x02) ? 1 : 0;	// Alarm 2 enabled
+	}
+}
+
+
+/******************************************************************************
+* Function: unsigned char AlarmKey (unsigned char key)
+*
+* Overview: Key events while an alarm rings. SET snoozes for
+*			ALARM_SNOOZE_MIN minutes, MODE turns it off. The events are
+*			used up so they do not also change the display or Setup.
+*
+* Input:    Key event
+*
+* Output:   0 if used, otherwise the key event
+*
+******************************************************************************/
+unsigned char AlarmKey(unsigned char key)
+{
+	if(AlarmRing == 0) return key;
+
+	if(key == (KEY_EV_PRESS|KEY_SET)) AlarmStop(1);		// Snooze
+	else if(key == (KEY_EV_PRESS|KEY_MODE)) AlarmStop(0);	// Off
+	return 0;
+}
+
+
+/******************************************************************************
+* Function: void AlarmStop (unsigned char snooze)
+*
+* Overview: Stops the ringing alarm, and with snooze set rings it again
+*			ALARM_SNOOZE_MIN minutes from now.
+*
+* Input:    snooze - 1 to snooze, 0 to turn it off
+*
+* Output:   None
+*
+******************************************************************************/
+void AlarmStop(unsigned char snooze)
+{
+	if(snooze)
+	{
+		SnoozeAt=((unsigned int)Hrs*60 + Min + ALARM_SNOOZE_MIN) % MINS_PER_DAY;
+		SnoozeIdx=AlarmRing-1;
+	}
+	else
+	{
+		SnoozeAt=0xFFFF;
+	}
+	AlarmRing=0;
+	SoundPlay(0);
+	AlarmSchedule();
+}
+
+
+/******************************************************************************
+* Function: void AlarmDisplay (unsigned char a)
+*
+* Overview: This function displays the Alarms time in 24 Hour format only
+*			F1 or F2 shows which alarm it is
+*
+* Input:    a - Alarm 0 to ALARM_COUNT-1
+*
+* Output:   None
+*
+******************************************************************************/
+void AlarmDisplay(unsigned char a)
+{
+
+	SEG_F1=(a == 0);SEG_F2=(a == 1);
+
+	// 24 Hour format - display seconds with leading zeros
+	ShowNumber((AlarmHrs[a]*100) + AlarmMin[a], 0);
+
+	// Show n for On or a o for Off
+	if(AlarmOn & (1<<a)) lcd_putc(CHAR_n,4,0);
+	else lcd_putc(CHAR_o,4,0);
+	
+}
+#endif // USE_ALARM
+
+
+/******************************************************************************
+* Function: void SoundPlay (const SOUND_STEP *pattern)
+*
+* Overview: Starts a sound pattern, replacing anything still playing.
+*			The pattern is a table of SOUND_STEPs ending with a zero length:
+*			- A tone (pr2 set) plays PR2/CCPR3L for len x 10ms, timed by
+*			  Timer4. Timer2 runs from Fosc so the CPU has to stay awake,
+*			  the main loop does not Sleep while SndTone is set.
+*			- A rest (pr2 = 0) waits len ticks (125ms) on Timer1 with Timer2,
+*			  Timer4 and CCP3 off, so the CPU sleeps through it.
+*			Only works if a Piezo is attached
+*			SndStep is set here and TMR4IF is set so the interrupt loads
+*			the first step. The hardware is only set up by the interrupt.
+*			With USE_BAT_RES and a long enough first tone the interrupt
+*			also takes a battery reading before the tone and one half way
+*			through it, for SoundService.
+*
+* Input:    pattern - Steps to play, 0 to stop
+*
+* Output:   None
+*
+******************************************************************************/
+#ifdef USE_ALARM
+void SoundPlay(const SOUND_STEP *pattern)
+{
+#ifdef USE_BAT_RES
+	unsigned char res;
+
+	res=(pattern && BatResMin != Min && pattern->pr2 && pattern->len >= BAT_RES_MIN_LEN);
+#endif
+	ClockSet(CLK_MID);						// Timer2 and Timer4 run from Fosc/4
+	GIE=0;									// The interrupt steps through the pattern
+	SndStep=pattern;
+	SndNew=1;
+#ifdef USE_BAT_RES
+	SndRes=res;
+	SndLoadQ3=0;
+#endif
+	TMR4IF=1;								// Load it now
+	GIE=1;
+}
+
+
+/******************************************************************************
+* Function: void SoundLoad (void)
+*
+* Overview: Sets up the hardware for the step at SndStep. Called from the
+*			interrupt for a new pattern and when a step has finished. A zero
+*			length step or no pattern gates the sound hardware off.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void SoundLoad(void)
+{
+	if(SndStep == 0 || SndStep->len == 0)	// End of the pattern
+	{
+		SoundOff();
+		return;
+	}
+
+	SndLeft=SndStep->len;
+	if(SndStep->pr2)						// Tone
+	{
+		PR2=SndStep->pr2;
+		CCPR3L=SndStep->duty;
+		CCP3CON=CCP3CON_LOAD;				// PWM mode
+		T2CON=T2CON_LOAD;					// Timer2 on for the PWM
+		TMR4=0;
+		T4CON=T4CON_LOAD;					// Timer4 on for the step length
+		SndTone=1;
+	}
+	else									// Rest, counted on Timer1 ticks
+	{
+		CCPR3L=0;
+		CCP3CON=0;
+		TMR2ON=0;
+		TMR4ON=0;
+		SndTone=0;
+	}
+}
+
+
+/******************************************************************************
+* Function: void SoundOff (void)
+*
+* Overview: Stops any sound and gates Timer2, Timer4 and CCP3 off. Called
+*			from the interrupt, main stops a pattern with SoundPlay(0).
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void SoundOff(void)
+{
+	CCPR3L=0;								// No output
+	CCP3CON=0;								// CCP3 off
+	TMR2ON=0;
+	TMR4ON=0;
+	SndTone=0;
+	SndStep=0;
+}
+
+
+/******************************************************************************
+* Function: void SoundService (void)
+*
+* Overview: Called every main loop pass. With USE_BAT_RES it passes the rest
+*			and loaded battery readings the interrupt took on the first
+*			tone of a pattern to BatResUpdate().
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void SoundService(void)
+{
+#ifdef USE_BAT_RES
+	unsigned int rest,load;
+
+	GIE=0;									// Set by the interrupt
+	rest=SndRestQ3;
+	load=SndLoadQ3;
+	SndLoadQ3=0;
+	GIE=1;
+	if(load == 0) return;					// None taken yet
+
+	BatResUpdate(rest,load);
+	BatResMin=Min;
+#endif
+}
+
+
+/******************************************************************************
+* Function: unsigned char SoundBusy (void)
+*
+* Overview: Tells the main loop if a pattern is playing. SndStep is a two
+*			byte pointer stepped by the interrupt, so it is read with the
+*			interrupt off.
+*
+* Input:    None
+*
+* Output:   1 while a pattern plays, 0 when silent
+*
+******************************************************************************/
+unsigned char SoundBusy(void)
+{
+	unsigned char busy;
+
+	GIE=0;
+	busy=(SndStep != 0);
+	GIE=1;
+	return busy;
+}
+#endif	// USE_ALARM
+
+/******************************************************************************
+* Function: unsigned int BatSample (void)
+*
+* Overview: Takes a battery reading from the Timer4 interrupt, so FvrConvert()
+*			is only called from the interrupt. A cap sense conversion in
+*			progress is let finish, and the ADC registers, including the
+*			result of the last cap sense conversion, and the FVR are put
+*			back as they were afterwards.
+*
+* Input:    None
+*
+* Output:   Battery in mV x8
+*
+******************************************************************************/
+#ifdef USE_BAT_RES
+unsigned int BatSample(void)
+{
+	unsigned char adcon0,adcon1,adresh,adresl,fvren;
+	unsigned int q3;
+
+	while(GO_nDONE);						// Let a cap sense conversion finish
+	adcon0=ADCON0; adcon1=ADCON1;
+	adresh=ADRESH; adresl=ADRESL;
+	fvren=FVREN;
+
+	ADON=0;									// Turn ADC OFF
+	ADCON1 = ADCON1_LOAD_2048;				// Set reference to 2.048V internal
+	FVREN=1;
+	while(FVRRDY==0);						// Wait for reference to get stable
+	q3=FvrConvert(ADC_SEL_BATTERY);
+
+	FVREN=fvren;
+	ADON=0;
+	ADCON1=adcon1;
+	ADCON0=adcon0;
+	ADRESH=adresh; ADRESL=adresl;			// cap_Sense() reads the result next tick
+	return q3;
+}
+
+
+/******************************************************************************
+* Function: void BatResUpdate (unsigned int rest, unsigned int load)
+*
+* Overview: The drop from the rest to the loaded reading is filtered (1/4)
+*			into BatDropQ2 (x4) and turned into the internal resistance
+*			R = drop / BAT_LOAD_MA. A fresh AAAA is a few hundred mOhm and
+*			at the end of life several Ohm.
+*
+* Input:    rest, load - Battery readings in mV x8
+*
+* Output:   None
+*
+******************************************************************************/
+void BatResUpdate(unsigned int rest, unsigned int load)
+{
+	unsigned int drop;
+
+	if(load < rest) drop=(rest-load)>>3;	// mV
+	else drop=0;
+
+	if(BatRes == 0) BatDropQ2=drop << 2;	// First measurement
+	else BatDropQ2+=drop - (BatDropQ2 >> 2);
+
+	BatRes=((unsigned long)BatDropQ2 * 250) / BAT_LOAD_MA;
+	if(BatRes == 0) BatRes=1;				// Measured
+}
+#endif
+
+
+/******************************************************************************
+* Function: void CapSenseCalibrate (void)
+*
+* Overview: Runs the cap sense Calibration and detects jam condition
+*
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void CapSenseCalibrate(void)
+{
+	static unsigned char CalCounter;
+	static unsigned int Press[2];
 
 
 	// Test for an individually jammed buttons
 	if(BTN1)
 	{
-		avgrst[0]++;
-		if(avgrst[0]>=AVGRST_MAX)
-		{
-			first=1;				// Reset the cap sense averages
-			SetupState=0;			// Force Exit of any setup routine
-		}
+		avgrst[0]++;
+		if(avgrst[0]>=AVGRST_MAX)
+		{
+			first=1;				// Reset the cap sense averages
+			if(SetupState) SetupExit(0);	// Force Exit of any setup routine
+		}
+	}
+	else
+	{
+		avgrst[0]=0;
+	}
+
+	if(BTN2)
+	{
+		avgrst[1]++;
+		if(avgrst[1]>=AVGRST_MAX)
+		{
+			first=1;				// Reset the cap sense averages
+			if(SetupState) SetupExit(0);	// Force Exit of any setup routine
+		}
+	}
+	else
+	{
+		avgrst[1]=0;
+	}
+
+
+
+	// Check for Calibration mode or a two button Jam	
+	switch(CalibrationMode)
+	{
+		case 0:
+			if(BTN1 && BTN2) CalibrationMode++;
+			return;
+
+		case 1:		// First Entry - store the raw data for the press level
+			if(BTN1 && BTN2)
+			{
+				Press[0]=raw[0];
+				Press[1]=raw[1];
+				CalCounter=0;
+				CalibrationMode++;
+			}
+			else	// Only a Glitch so ignore
+			{
+				CalibrationMode=0;
+			}
+			break;
+		
+
+		case 2:		// Start timing the dual hold to capture a lock on
+			SEG_F1=1;				// Indicate calibration Mode
+			
+				
+			if(BTN1 && BTN2)		// Inc counter if both buttones pressed
+			{
+				CalCounter++;
+				if(CalCounter > 20)			// More than 5 seconds of both held - must be error
+				{
+					first=1;				// Reset the cap sense averages
+					if(SetupState) SetupExit(0);	// Force Exit of any setup routine
+					CalibrationMode++;		// Exit the calibration
+					break;
+				}
+			}
+			else
+			{
+				// Wait for both buttons released then do the calibration
+				if(BTN1==0 && BTN2==0)
+				{
+					thold[0]=(raw[0]-Press[0])/2;	
+					if(thold[0]< thresholdmin)thold[0]=thresholdmin;
+					if(thold[0]> thresholdmax)thold[0]=thresholdmax;
+
+					thold[1]=(raw[1]-Press[1])/2;
+					if(thold[1]< thresholdmin)thold[1]=thresholdmin;
+					if(thold[1]> thresholdmax)thold[1]=thresholdmax;
+#ifdef USE_CS_ARBITRATION
+					cs_calibrated=1;
+#endif
+
+#ifdef USE_CS_EEPROM
+					cs_ee_base[0]=raw[0];	// Buttons are released here
+					cs_ee_base[1]=raw[1];
+					CapSenseSave();			// Keep it over a reset or battery change
+#endif
+
+					CalibrationMode++;
+					first=1;				// Reset the cap sense averages
+				}
+									
+			}
+			break;
+			
+
+
+
+
+		default:	// Exit
+			CalibrationMode=0;
+			SEG_F1=0;
+			break;
+			
+		
+	}			
+
+}
+
+
+
+
+
+/******************************************************************************
+* Function: void CapSenseLoad (void)
+*
+* Overview: Loads this unit's cap sense calibration from data EEPROM.
+*			The block is only used if the magic and checksum are good, the
+*			thresholds are clamped to the allowed range and the reference
+*			baselines are kept for CapSenseRestore() to check on the first scan.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+#ifdef USE_CS_EEPROM
+void CapSenseLoad(void)
+{
+	unsigned char i,sum,*ee;
+
+	ee=EeBuf.cs;							// No write in progress yet
+	EeRead(EE_CS_BASE,ee,EE_CS_SIZE);
+	sum=0;
+	for(i=0;i<EE_CS_SIZE;i++)sum+=ee[i];
+	if(ee[0] != EE_CS_MAGIC || sum != 0) return;	// Blank or corrupt, keep defaults
+
+	thold[0]=ee[1];
+	thold[1]=ee[2];
+	for(i=0;i<2;i++)
+	{
+		if(thold[i]< thresholdmin)thold[i]=thresholdmin;
+		if(thold[i]> thresholdmax)thold[i]=thresholdmax;
+	}
+
+	cs_ee_base[0]=ee[3] + (ee[4] << 8);
+	cs_ee_base[1]=ee[5] + (ee[6] << 8);
+	cs_ee_valid=1;
+	cs_ee_saved=1;
+#ifdef USE_CS_ARBITRATION
+	cs_calibrated=1;
+#endif
+}
+
+
+/******************************************************************************
+* Function: void CapSenseSave (void)
+*
+* Overview: Stores the calibrated thresholds and the reference baselines
+*			in cs_ee_base[] in data EEPROM with a checksum, written by the
+*			EEPROM interrupt from EeBuf. The checksum byte makes the block
+*			sum to zero and is the last byte written. While another write
+*			is in progress cs_ee_saved is left at 2 and CapSenseRefresh()
+*			tries again the next second.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void CapSenseSave(void)
+{
+	unsigned char i,sum,*ee;
+
+	cs_ee_saved=2;						// Due
+	if(EeLeft || WR) return;			// EeBuf in use
+	ee=EeBuf.cs;
+	ee[0]=EE_CS_MAGIC;
+	ee[1]=thold[0];
+	ee[2]=thold[1];
+	ee[3]=cs_ee_base[0] & 0xFF;
+	ee[4]=cs_ee_base[0] >> 8;
+	ee[5]=cs_ee_base[1] & 0xFF;
+	ee[6]=cs_ee_base[1] >> 8;
+
+	sum=0;
+	for(i=0;i<EE_CS_SIZE-1;i++)sum+=ee[i];
+	ee[EE_CS_SIZE-1]=0-sum;
+
+	EeStart(EE_CS_BASE,ee,EE_CS_SIZE);	// Unchanged bytes are skipped
+	cs_ee_saved=1;
+}
+
+
+/******************************************************************************
+* Function: void CapSenseRestore (void)
+*
+* Overview: Called from the interrupt on the first scan after power up with
+*			the averages preset from the live readings. For each button the
+*			live reading is checked against the stored reference:
+*			- Within one threshold, the live reading is good and is kept
+*			- Lower by up to a palm, a finger is on the pad so the stored
+*			  baseline is used and the press is seen straight away
+*			- Anything else, the unit or its mounting changed, keep live
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void CapSenseRestore(void)
+{
+	unsigned char i;
+	signed int diff;
+
+	for(i=0;i<2;i++)
+	{
+		diff=cs_ee_base[i]-raw[i];		// positive when live reads touched
+		if(diff > thold[i] && diff < (thold[i] << CS_PALM_SHIFT))
+		{
+			avg[i]=cs_ee_base[i] << 5;
+		}
+	}
+	cs_ee_valid=0;						// Only used at power up
+}
+
+
+/******************************************************************************
+* Function: void CapSenseRefresh (void)
+*
+* Overview: Called once a second, starts a CapSenseSave() that had to wait.
+*			Then once a minute, every CS_REFRESH_MIN minutes with both
+*			pads released the live baselines are checked against the stored
+*			ones. If either has drifted by more than half its threshold the
+*			block is rewritten, so at power up a drifted pad is not taken
+*			for a finger by CapSenseRestore(). A pad that stays touched
+*			puts the check off a minute at a time.
+*			Wear: at most one write an hour and only after a real drift,
+*			under 9000 a year against 100K for a cell.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void CapSenseRefresh(void)
+{
+	unsigned char i,moved;
+	unsigned int live[2];
+	signed int diff;
+
+	if(cs_ee_saved == 2)
+	{
+		CapSenseSave();
+		return;
+	}
+	if(Sec != 0) return;
+	if(cs_ee_saved == 0 || cs_ee_valid) return;	// Nothing stored, or the first scan is still to come
+	if(CsRefreshMin < CS_REFRESH_MIN) CsRefreshMin++;
+	if(CsRefreshMin < CS_REFRESH_MIN) return;
+	if(BTN1 || BTN2 || reject || first || CalibrationMode) return;	// Try again next minute
+
+	GIE=0;								// The interrupt updates the averages
+	live[0]=avg[0] >> 5;
+	live[1]=avg[1] >> 5;
+	GIE=1;
+	CsRefreshMin=0;
+
+	moved=0;
+	for(i=0;i<2;i++)
+	{
+		diff=cs_ee_base[i]-live[i];
+		if(diff > (thold[i] >> 1) || diff < -(thold[i] >> 1)) moved=1;
+	}
+	if(moved == 0) return;				// Close enough, save the wear
+
+	cs_ee_base[0]=live[0];
+	cs_ee_base[1]=live[1];
+	CapSenseSave();
+}
+#endif
+
+
+/******************************************************************************
+* Function: void KeyScan (void)
+*
+* Overview: Turns the BTN1/BTN2 levels into key events. Called once per
+*			cap sense scan. A press, release or change between one and two
+*			keys gives one event. Holding a key gives a long press after
+*			KEY_LONG_TICKS then auto repeats, going faster after KEY_FAST_TICKS.
+*			A press of one key from none is held for KEY_CHORD_TICKS. If the
+*			other key joins in that time only the two key press is sent, if
+*			the key is let go first the press goes ahead of its release.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void KeyScan(void)
+{
+	unsigned char now,keys,elapsed;
+
+	now=TickStamp;						// Ticks since the last scan
+	elapsed=now-KeyStamp;
+	KeyStamp=now;
+
+	keys=0;
+	if(BTN1)keys|=KEY_SET;
+	if(BTN2)keys|=KEY_MODE;
+
+	if(keys != KeyLast)
+	{
+		if(KeyPend && (KeyLast & ~keys)) KeyPut(KEY_EV_PRESS | KeyPend);	// Tapped inside the window
+		KeyPend=0;
+		if(keys & ~KeyLast)												// New key down
+		{
+			if(KeyLast == 0 && keys != KEY_BOTH) KeyPend=keys;			// Wait for a chord
+			else KeyPut(KEY_EV_PRESS | keys);
+		}
+		if(KeyLast & ~keys) KeyPut(KEY_EV_RELEASE | (KeyLast & ~keys));	// Key(s) up
+		KeyLast=keys;
+		KeyHeld=0;						// Restart hold timing on any change
+		KeyNext=KEY_LONG_TICKS;
+	}
+	else if(keys)
+	{
+		if(KeyHeld < 0xFF00) KeyHeld+=elapsed;
+
+		if(KeyPend && KeyHeld >= KEY_CHORD_TICKS)
+		{
+			KeyPut(KEY_EV_PRESS | KeyPend);	// No chord, send the single press
+			KeyPend=0;
+		}
+
+		if(KeyHeld >= KeyNext)
+		{
+			if(KeyNext == KEY_LONG_TICKS) KeyPut(KEY_EV_LONG | keys);
+			else KeyPut(KEY_EV_REPEAT | keys);
+
+			if(KeyHeld < KEY_FAST_TICKS) KeyNext=KeyHeld+KEY_REPEAT_SLOW;
+			else KeyNext=KeyHeld+KEY_REPEAT_FAST;
+		}
+	}
+}
+
+
+/******************************************************************************
+* Function: void KeyPut (unsigned char event)
+*
+* Overview: Adds an event to the key queue.
+*			If the queue is full the new event is dropped.
+*
+* Input:    unsigned char event - Event code
+*
+* Output:   None
+*
+******************************************************************************/
+void KeyPut(unsigned char event)
+{
+	unsigned char next;
+
+	next=(KeyHead+1) & (KEY_QUEUE_SIZE-1);
+	if(next == KeyTail) return;			// Full
+
+	KeyQueue[KeyHead]=event;
+	KeyHead=next;
+}
+
+
+/******************************************************************************
+* Function: unsigned char KeyGet (void)
+*
+* Overview: Takes the oldest event from the key queue.
+*
+* Input:    None
+*
+* Output:   Event code, or 0 if the queue is empty
+*
+******************************************************************************/
+unsigned char KeyGet(void)
+{
+	unsigned char event;
+
+	if(KeyHead == KeyTail) return 0;	// Empty
+
+	event=KeyQueue[KeyTail];
+	KeyTail=(KeyTail+1) & (KEY_QUEUE_SIZE-1);
+	return event;
+}
+
+
+/******************************************************************************
+* Function: unsigned char EeStart (unsigned char addr, unsigned char *src,
+*									unsigned char len)
+*
+* Overview: Starts an interrupt driven EEPROM write. EEIF is set here so
+*			the interrupt starts the first byte, and each EEIF after that
+*			starts the next, so the CPU can sleep through the ~4ms per byte.
+*			src must stay unchanged until EeLeft is 0 and WR is clear.
+*			Bytes that already hold the value are skipped.
+*
+* Input:    addr - first EEPROM address
+*			src - bytes to write
+*			len - number of bytes, 1 or more
+*
+* Output:   1 if started (or nothing to write), 0 if a write is in progress
+*
+******************************************************************************/
+unsigned char EeStart(unsigned char addr, unsigned char *src, unsigned char len)
+{
+	if(EeLeft || WR) return 0;
+	GIE=0;
+	EeAddr=addr;
+	EeSrc=src;
+	EeLeft=len;
+	EEIF=1;								// EeNext() runs in the interrupt
+	EEIE=1;
+	GIE=1;
+	return 1;
+}
+
+
+/******************************************************************************
+* Function: void EeNext (void)
+*
+* Overview: Starts the write of the next byte that differs from the
+*			EEPROM. A byte that is already there costs a read instead of
+*			a 4ms write and its wear. Only called from the interrupt.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void EeNext(void)
+{
+	CFGS=0;								// Data EEPROM
+	EEPGD=0;
+	while(EeLeft)
+	{
+		EeLeft--;
+		EEADRL=EeAddr++;
+		RD=1;
+		if(EEDATL == *EeSrc)
+		{
+			EeSrc++;					// Unchanged
+			continue;
+		}
+		EEDATL=*EeSrc++;
+		WREN=1;
+		EECON2=0x55;					// Unlock sequence
+		EECON2=0xAA;
+		WR=1;
+		WREN=0;
+		return;
+	}
+}
+
+
+/******************************************************************************
+* Function: void EeRead (unsigned char addr, unsigned char *dst,
+*							unsigned char len)
+*
+* Overview: Reads a block of data EEPROM into RAM.
+*
+* Input:    addr - first EEPROM address
+*			dst - where to put the bytes
+*			len - number of bytes
+*
+* Output:   None
+*
+******************************************************************************/
+void EeRead(unsigned char addr, unsigned char *dst, unsigned char len)
+{
+	while(len--) *dst++=eeprom_read(addr++);
+}
+
+
+/******************************************************************************
+* Function: unsigned char Crc8 (unsigned char *p, unsigned char len)
+*
+* Overview: CRC-8 with polynomial 0x07, initial value 0
+*
+* Input:    p - bytes
+*			len - number of bytes
+*
+* Output:   CRC
+*
+******************************************************************************/
+unsigned char Crc8(unsigned char *p, unsigned char len)
+{
+	unsigned char crc=0,i;
+
+	while(len--)
+	{
+		crc^=*p++;
+		for(i=0;i<8;i++)
+		{
+			if(crc & 0x80) crc=(crc << 1) ^ 0x07;
+			else crc<<=1;
+		}
+	}
+	return crc;
+}
+
+
+/******************************************************************************
+* Function: void SettingsFill (SETTINGS *s)
+*
+* Overview: Fills the settings part of a record from the current settings.
+*			Without USE_ALARM the alarm fields are 0 so the layout is fixed.
+*
+* Input:    s - record to fill
+*
+* Output:   None
+*
+******************************************************************************/
+#ifdef USE_SETTINGS_EE
+void SettingsFill(SETTINGS *s)
+{
+	unsigned char a;
+
+	s->ampm=AMPM;
+	s->degcf=DEGCF;
+	for(a=0;a<ALARM_COUNT;a++)
+	{
+#ifdef USE_ALARM
+		s->alarm_hrs[a]=AlarmHrs[a];
+		s->alarm_min[a]=AlarmMin[a];
+#else
+		s->alarm_hrs[a]=s->alarm_min[a]=0;
+#endif
+	}
+#ifdef USE_ALARM
+	s->alarm_on=AlarmOn;
+#else
+	s->alarm_on=0;
+#endif
+}
+
+
+/******************************************************************************
+* Function: void SettingsSave (void)
+*
+* Overview: Called once a second outside Setup. The record for the current
+*			settings is built in EeBuf and compared with the newest one in
+*			EEPROM. If they differ it is written with the next sequence
+*			number and its CRC to the next slot of the ring. The CRC is the
+*			last byte written, so a write cut short leaves the previous
+*			record as the newest valid one. While a write is in progress
+*			the save waits for the next second. With no valid record in
+*			the ring the first save writes the defaults.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void SettingsSave(void)
+{
+	unsigned char i,addr,*p;
+
+	if(EeLeft || WR) return;				// EeBuf in use, try again next second
+
+	p=(unsigned char *)&EeBuf.set;
+	SettingsFill(&EeBuf.set);
+	EeBuf.set.seq=SetSeq;
+	EeBuf.set.ver=SET_VERSION;
+	EeBuf.set.crc=Crc8(p,sizeof(SETTINGS)-1);
+	addr=EE_SET_BASE + SetSlot*EE_SET_STRIDE;
+	for(i=0;i<sizeof(SETTINGS);i++)
+	{
+		if(eeprom_read(addr+i) != p[i]) break;
 	}
-	else
+	if(i == sizeof(SETTINGS)) return;		// No change
+
+	EeBuf.set.seq=++SetSeq;
+	EeBuf.set.crc=Crc8(p,sizeof(SETTINGS)-1);
+	if(++SetSlot >= EE_SET_SLOTS) SetSlot=0;
+	EeStart(EE_SET_BASE + SetSlot*EE_SET_STRIDE,p,sizeof(SETTINGS));
+}
+
+
+/******************************************************************************
+* Function: void SettingsLoad (void)
+*
+* Overview: Called from Init. Reads every slot of the ring once and keeps the
+*			valid record with the newest sequence number, then applies it.
+*			With no valid record the defaults stay.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void SettingsLoad(void)
+{
+	unsigned char slot,found=0,*p;
+
+	p=(unsigned char *)&EeBuf.set;			// No write in progress yet
+	for(slot=0;slot<EE_SET_SLOTS;slot++)
 	{
-		avgrst[0]=0;
+		EeRead(EE_SET_BASE + slot*EE_SET_STRIDE,p,sizeof(SETTINGS));
+		if(EeBuf.set.ver != SET_VERSION || EeBuf.set.crc != Crc8(p,sizeof(SETTINGS)-1)) continue;
+		if(found && (signed char)(EeBuf.set.seq - SetSeq) <= 0) continue;
+		SetSeq=EeBuf.set.seq;
+		SetSlot=slot;
+		found=1;
 	}
 
-	if(BTN2)
+	if(!found) return;						// Defaults stay
+	EeRead(EE_SET_BASE + SetSlot*EE_SET_STRIDE,p,sizeof(SETTINGS));
+	SettingsApply(&EeBuf.set);
+}
+
+
+/******************************************************************************
+* Function: void SettingsApply (SETTINGS *s)
+*
+* Overview: Makes the settings of a checked record the current settings.
+*			Alarm times out of range are left as they are.
+*
+* Input:    s - record
+*
+* Output:   None
+*
+******************************************************************************/
+void SettingsApply(SETTINGS *s)
+{
+#ifdef USE_ALARM
+	unsigned char a;
+#endif
+
+	AMPM=s->ampm;
+	DEGCF=s->degcf;
+#ifdef USE_ALARM
+	for(a=0;a<ALARM_COUNT;a++)
 	{
-		avgrst[1]++;
-		if(avgrst[1]>=AVGRST_MAX)
+		if(s->alarm_hrs[a] > 23 || s->alarm_min[a] > 59) continue;
+		AlarmHrs[a]=s->alarm_hrs[a];
+		AlarmMin[a]=s->alarm_min[a];
+	}
+	AlarmOn=s->alarm_on;
+#endif
+}
+#endif
+
+
+/******************************************************************************
+* Function: void CkptCheck (void)
+*
+* Overview: Called once a second, acts on a new battery reading. The
+*			unfiltered reading is used so a failing cell is seen one
+*			reading sooner. A reading below CKPT_LEVEL, a fall of more
+*			than CKPT_DROP since the last or the battery manager going
+*			Critical writes the checkpoint. It is written again only when
+*			the battery manager goes Critical after that, so a cell that
+*			sits low for days does not wear the EEPROM. The restored time
+*			is flagged approximate. EeNext only writes the bytes that
+*			changed.
+*			When the cell is back above CKPT_LEVEL + BAT_HYST_STATE the
+*			checkpoint is marked used so a stale time is never restored.
+*			The PIC16LF1933 has no HLVD and VDD is held up by the boost
+*			converter until the cell is nearly flat, so the battery input
+*			is watched instead of VDD.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+#ifdef USE_CHECKPOINT
+void CkptCheck(void)
+{
+	unsigned int mv,last;
+
+	if(CkptV == 0) return;					// No new reading
+	mv=CkptV;
+	CkptV=0;
+	last=CkptLastV;
+	CkptLastV=mv;
+
+	if(CkptState)
+	{
+#ifdef USE_BAT_MANAGER
+		if(CkptState == 1 && BatState == BAT_CRITICAL)
 		{
-			first=1;				// Reset the cap sense averages
-			SetupState=0;			// Force Exit of any setup routine
+			CkptWrite();					// Worse since the first write, bring the time up to date
+			CkptState=2;
+			return;
 		}
+#endif
+		if(mv <= CKPT_LEVEL + BAT_HYST_STATE || EeLeft || WR) return;
+		EeBuf.ckpt.magic=0;					// Recovered, the checkpoint is stale
+		EeStart(EE_CKPT_BASE,&EeBuf.ckpt.magic,1);
+		CkptState=0;
+		return;
 	}
-	else
+	if(mv < CKPT_LEVEL || (last && mv + CKPT_DROP < last)
+#ifdef USE_BAT_MANAGER
+		|| BatState == BAT_CRITICAL
+#endif
+		)
 	{
-		avgrst[1]=0;
+		CkptWrite();
+		CkptState=1;
+#ifdef USE_BAT_MANAGER
+		if(BatState == BAT_CRITICAL) CkptState=2;
+#endif
 	}
+}
 
 
+/******************************************************************************
+* Function: void CkptWrite (void)
+*
+* Overview: Writes the time and the current settings, Setup edits
+*			included, to the checkpoint. A write in progress is waited for,
+*			at most a settings record. EeNext skips the bytes that have not
+*			changed since the last checkpoint, so normally only the time
+*			and the CRC are written, ~20ms, sizeof(CKPT) bytes at most.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void CkptWrite(void)
+{
+	while(EeLeft || WR);					// Bounded by the longest write, then EeBuf is free
+	EeBuf.ckpt.hrs=Hrs;
+	EeBuf.ckpt.min=Min;
+	EeBuf.ckpt.sec=Sec;
+	SettingsFill(&EeBuf.ckpt.set);
+	EeBuf.ckpt.set.seq=SetSeq;
+	EeBuf.ckpt.set.ver=SET_VERSION;
+	EeBuf.ckpt.set.crc=Crc8((unsigned char *)&EeBuf.ckpt.set,sizeof(SETTINGS)-1);
+	EeBuf.ckpt.magic=CKPT_MAGIC;
+	EeBuf.ckpt.crc=Crc8((unsigned char *)&EeBuf.ckpt,sizeof(CKPT)-1);
+	EeStart(EE_CKPT_BASE,(unsigned char *)&EeBuf.ckpt,sizeof(CKPT));
+}
 
-	// Check for Calibration mode or a two button Jam	
-	switch(CalibrationMode)
+
+/******************************************************************************
+* Function: void CkptLoad (void)
+*
+* Overview: Called from Init after PersistRestore. A valid checkpoint is
+*			used once and marked used. After a warm restore the time in RAM
+*			is exact and the checkpoint is only cleared. Otherwise the time
+*			comes back from it with TimeApprox set, as the time the cell
+*			was out is not known. Its settings are applied if no settings
+*			record was written after it.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void CkptLoad(void)
+{
+	unsigned char *p;
+
+	p=(unsigned char *)&EeBuf.ckpt;			// No write in progress yet
+	EeRead(EE_CKPT_BASE,p,sizeof(CKPT));
+	if(EeBuf.ckpt.magic != CKPT_MAGIC || EeBuf.ckpt.crc != Crc8(p,sizeof(CKPT)-1)) return;
+	eeprom_write(EE_CKPT_BASE,0);			// Used
+	if(PersistLost) return;					// Warm restore, exact time
+	if(EeBuf.ckpt.hrs > 23 || EeBuf.ckpt.min > 59 || EeBuf.ckpt.sec > 59) return;
+
+	Hrs=EeBuf.ckpt.hrs;
+	Min=EeBuf.ckpt.min;
+	Sec=EeBuf.ckpt.sec;
+	TimeApprox=1;
+	if(EeBuf.ckpt.set.seq == SetSeq) SettingsApply(&EeBuf.ckpt.set);	// SettingsSave makes it a record
+}
+#endif
+
+
+/******************************************************************************
+* Function: void LogInit (void)
+*
+* Overview: Called from Init. Finds the block with the newest sequence
+*			number so the log carries on after it. The first sample after
+*			a reset starts a new block, the time may have changed.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+#ifdef USE_HISTORY
+void LogInit(void)
+{
+	LOG_HEAD *h;
+	unsigned char blk,found=0;
+
+	h=&EeBuf.log.head;						// No write in progress yet
+	for(blk=0;blk<LOG_BLOCKS;blk++)
 	{
-		case 0:
-			if(BTN1 && BTN2) CalibrationMode++;
-			return;
+		EeRead(EE_LOG_BASE + blk*LOG_BLOCK,(unsigned char *)h,sizeof(LOG_HEAD));
+		if(h->stamp >= MINS_PER_DAY || h->ivl == 0) continue;	// Never written
+		if(found && (signed char)(h->seq - LogSeq) <= 0) continue;
+		LogSeq=h->seq;
+		LogBlock=blk;
+		found=1;
+	}
+}
 
-		case 1:		// First Entry - store the raw data for the press level
-			if(BTN1 && BTN2)
-			{
-				Press[0]=raw[0];
-				Press[1]=raw[1];
-				CalCounter=0;
-				CalibrationMode++;
-			}
-			else	// Only a Glitch so ignore
-			{
-				CalibrationMode=0;
-			}
-			break;
-		
 
-		case 2:		// Start timing the dual hold to capture a lock on
-			SEG_F1=1;				// Indicate calibration Mode
-			
-				
-			if(BTN1 && BTN2)		// Inc counter if both buttones pressed
-			{
-				CalCounter++;
-				if(CalCounter > 20)			// More than 5 seconds of both held - must be error
-				{
-					first=1;				// Reset the cap sense averages
-					SetupState=0;			// Force Exit of any setup routine	
-					CalibrationMode++;		// Exit the calibration
-					break;
-				}
-			}
-			else
-			{
-				// Wait for both buttons released then do the calibration
-				if(BTN1==0 && BTN2==0)
-				{
-					thold[0]=(raw[0]-Press[0])/2;	
-					if(thold[0]< thresholdmin)thold[0]=thresholdmin;
-					if(thold[0]> thresholdmax)thold[0]=thresholdmax;
+/******************************************************************************
+* Function: void LogSecond (void)
+*
+* Overview: Called once a second. Logs a sample every LOG_INTERVAL_MIN once
+*			there are battery and temperature readings. While an EEPROM
+*			write is in progress the sample waits for the next second.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void LogSecond(void)
+{
+	if(LogWait)
+	{
+		LogWait--;
+		return;
+	}
+	if(BatteryQ3 == 0 || TemperatureQ3 == 0) return;	// No readings yet
+	if(EeLeft || WR) return;
+	LogSample();
+	LogWait=LOG_INTERVAL_MIN*60U - 1;
+}
 
-					thold[1]=(raw[1]-Press[1])/2;
-					if(thold[1]< thresholdmin)thold[1]=thresholdmin;
-					if(thold[1]> thresholdmax)thold[1]=thresholdmax;
 
+/******************************************************************************
+* Function: void LogSample (void)
+*
+* Overview: Writes TemperatureV and BatteryV to the log. If both changes
+*			since the last sample fit a nibble, -8 to 7 but not both -8,
+*			one byte and LOG_END after it are written. Otherwise, or when
+*			the block is full, the next block is started with a header
+*			holding the time and the sample. 1, 2 or 7 bytes per sample.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void LogSample(void)
+{
+	unsigned int v;
+	unsigned char t,b,addr;
+	signed int dt,db;
+
+	v=TemperatureV >> LOG_SHIFT;
+	t=(v > 255) ? 255 : v;
+	v=BatteryV >> LOG_SHIFT;
+	b=(v > 255) ? 255 : v;
+	dt=(signed int)t - LogT;
+	db=(signed int)b - LogB;
+	LogT=t;
+	LogB=b;
+
+	if(LogN < LOG_DATA && dt >= -8 && dt <= 7 && db >= -8 && db <= 7 && (dt != -8 || db != -8))
+	{
+		addr=EE_LOG_BASE + LogBlock*LOG_BLOCK + sizeof(LOG_HEAD) + LogN;
+		EeBuf.delta[0]=((unsigned char)dt << 4) | ((unsigned char)db & 0x0F);
+		EeBuf.delta[1]=LOG_END;
+		LogN++;
+		EeStart(addr,EeBuf.delta,(LogN < LOG_DATA) ? 2 : 1);
+		return;
+	}
 
+	if(++LogBlock >= LOG_BLOCKS) LogBlock=0;	// Over the oldest block
+	EeBuf.log.head.seq=++LogSeq;
+	EeBuf.log.head.stamp=Hrs*60 + Min;
+	EeBuf.log.head.ivl=LOG_INTERVAL_MIN;
+	EeBuf.log.head.t0=t;
+	EeBuf.log.head.b0=b;
+	EeBuf.log.end=LOG_END;
+	LogN=0;
+	EeStart(EE_LOG_BASE + LogBlock*LOG_BLOCK,(unsigned char *)&EeBuf.log,sizeof(LOG_HEAD)+1);
+}
 
-					CalibrationMode++;
-					first=1;				// Reset the cap sense averages
-				}
-									
-			}
-			break;
-			
+
+/******************************************************************************
+* Function: void LogOpen (LOG_CUR *c)
+*
+* Overview: Puts a cursor before the oldest sample of the log, the block
+*			after LogBlock. LogNext then reads the samples in order, this
+*			is also the read out path for anything that wants them.
+*
+* Input:    c - cursor
+*
+* Output:   None
+*
+******************************************************************************/
+void LogOpen(LOG_CUR *c)
+{
+	c->blk=LogBlock;
+	c->k=0;
+	c->i=LOG_DATA;							// Start on the next block
+}
 
 
+/******************************************************************************
+* Function: unsigned char LogNext (LOG_CUR *c)
+*
+* Overview: Decodes the next sample into c->t and c->b, from the deltas
+*			of the block or the header of the next one written. One
+*			EEPROM byte per delta, so a walk of the log is linear. No
+*			EEPROM write may be in progress, see HistStats.
+*
+* Input:    c - cursor from LogOpen
+*
+* Output:   1 with the sample in the cursor, 0 past the newest
+*
+******************************************************************************/
+unsigned char LogNext(LOG_CUR *c)
+{
+	LOG_HEAD h;
+	unsigned char d,addr;
 
+	if(c->i < LOG_DATA)
+	{
+		d=eeprom_read(EE_LOG_BASE + c->blk*LOG_BLOCK + sizeof(LOG_HEAD) + c->i);
+		if(d != LOG_END)
+		{
+			c->i++;
+			c->t+=((d >> 4) ^ 8) - 8;		// Sign extend the nibbles
+			c->b+=((d & 0x0F) ^ 8) - 8;
+			return 1;
+		}
+	}
+	while(c->k < LOG_BLOCKS)
+	{
+		c->k++;
+		if(++c->blk >= LOG_BLOCKS) c->blk=0;
+		addr=EE_LOG_BASE + c->blk*LOG_BLOCK;
+		EeRead(addr,(unsigned char *)&h,sizeof(LOG_HEAD));
+		if(h.stamp >= MINS_PER_DAY || h.ivl == 0) continue;	// Never written
+		c->t=h.t0;
+		c->b=h.b0;
+		c->i=0;
+		return 1;
+	}
+	return 0;
+}
 
-		default:	// Exit
-			CalibrationMode=0;
-			SEG_F1=0;
-			break;
-			
-		
-	}			
 
+/******************************************************************************
+* Function: void HistStats (void)
+*
+* Overview: Reads the temperature range and the changes over the last
+*			LOG_TREND_MIN from the log, in LOG_SHIFT units. With less than
+*			that logged the change is from the oldest sample.
+*			Two passes over the log, the first for the range and the
+*			count, the second stops at the sample a day back.
+*			A write in progress is let finish first, as the EEIF interrupt
+*			would change EEADRL and EECON1 under eeprom_read(). Writes are
+*			only started from the main loop, so none starts during the walk.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void HistStats(void)
+{
+	LOG_CUR c;
+	unsigned char n,t,b,back;
+
+	while(EeLeft || WR);					// At most a settings record, ~60ms
+	HistMin=0xFF;
+	HistMax=0;
+	n=0;
+	LogOpen(&c);
+	while(LogNext(&c))
+	{
+		if(c.t < HistMin) HistMin=c.t;
+		if(c.t > HistMax) HistMax=c.t;
+		n++;
+	}
+	HistN=n;
+	if(n == 0) return;
+	t=c.t;									// Newest
+	b=c.b;
+	back=LOG_TREND_MIN / LOG_INTERVAL_MIN;
+	n=(n > back) ? n-back : 1;				// Samples up to the one a day back
+	LogOpen(&c);
+	while(n--) LogNext(&c);
+	HistDT=(signed int)t - c.t;
+	HistDB=(signed int)b - c.b;
+	if(HistDT < -(T_OFFSET_ZERO >> LOG_SHIFT)) HistDT=-(T_OFFSET_ZERO >> LOG_SHIFT);	// Shown from T_OFFSET_ZERO
+}
+
+
+/******************************************************************************
+* Function: void HistKey (void)
+*
+* Overview: A MODE press in the run state shows the next history page for
+*			HIST_PAGE_S seconds. The log is read on the first page.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void HistKey(void)
+{
+	if(HistPage == 0) HistStats();
+	if(++HistPage > HIST_PAGES) HistPage=1;
+	HistSec=HIST_PAGE_S;
 }
 
 
+/******************************************************************************
+* Function: void HistDisplay (void)
+*
+* Overview: Displays a history page. Temperature max with 'H', min with
+*			'L', the change over a day with 'r', then the battery change
+*			over a day in mV with 'b'. Dashes until a sample is logged.
+*
+* Input:    None
+*
+* Output:   None
+*
+******************************************************************************/
+void HistDisplay(void)
+{
+	unsigned int mv;
+
+	if(HistN == 0 || HistPage == HIST_PAGES)
+	{
+		SEG_COLON=0;
+		BatteryBars();
+		if(HistN == 0)
+		{
+			lcd_putc(CHAR_MINUS,3,0);
+			lcd_putc(CHAR_MINUS,2,0);
+			lcd_putc(CHAR_MINUS,1,0);
+			lcd_putc(CHAR_MINUS,0,0);
+		}
+		else
+		{
+			mv=((HistDB < 0) ? -HistDB : HistDB) << LOG_SHIFT;
+			if(mv > 999) mv=999;
+			ShowNumber(mv,0x80);
+			if(HistDB < 0) lcd_putc(CHAR_MINUS,3,0);
+		}
+		lcd_putc(HistCorner[HistPage-1],4,0);
+		return;
+	}
+
+	if(HistPage == 1) TemperatureShow((unsigned int)HistMax << (LOG_SHIFT+3),CHAR_H,0);
+	else if(HistPage == 2) TemperatureShow((unsigned int)HistMin << (LOG_SHIFT+3),CHAR_L,0);
+	else TemperatureShow((T_OFFSET_ZERO<<3) + HistDT*(8 << LOG_SHIFT),CHAR_r,1);	// Change, C or F
+}
+#endif
 
 
 
@@ -48,7 +48,51 @@
 //*****************************************************************************
 // Global Knobs
 //*****************************************************************************
+// Not all of them fit the 256 bytes of RAM together, the alarm, the
+// checkpoint and the history are left out by default.
 //#define USE_ALARM				// COMMENT OUT TO DISABLE THE ALARM FEATURES
+#define USE_CS_MEDIAN			// COMMENT OUT TO DISABLE THE CAP SENSE MEDIAN-OF-3 SPIKE FILTER
+#define USE_CS_ARBITRATION		// COMMENT OUT TO DISABLE THE PALM/WATER/CROSS TALK REJECTION
+#define USE_PROXIMITY			// COMMENT OUT TO DISABLE THE IDLE PROXIMITY SCAN
+#define USE_CS_TEMPCOMP			// COMMENT OUT TO DISABLE THE CAP SENSE TEMPERATURE COMPENSATION
+#define USE_CS_EEPROM			// COMMENT OUT TO NOT KEEP THE CAP SENSE CALIBRATION IN EEPROM
+#define USE_ADC_OVERSAMPLE		// COMMENT OUT FOR SINGLE BATTERY/TEMPERATURE CONVERSIONS AND WHOLE DEGREES
+#define USE_BAT_MANAGER			// COMMENT OUT TO DISABLE THE LOW/CRITICAL BATTERY STATES
+#define USE_BAT_GAUGE			// COMMENT OUT TO DISABLE THE DAYS REMAINING ESTIMATE
+#define USE_BAT_RES				// COMMENT OUT TO NOT MEASURE THE BATTERY UNDER THE PIEZO LOAD
+#define USE_LCD_STANDBY			// COMMENT OUT TO KEEP THE DISPLAY ON WHEN NOT IN USE
+#define USE_LCD_ADAPT			// COMMENT OUT FOR A FIXED LCD LADDER POWER AND CONTRAST
+#define USE_SETTINGS_EE			// COMMENT OUT TO NOT KEEP THE SETTINGS IN EEPROM
+//#define USE_CHECKPOINT		// COMMENT OUT TO NOT CHECKPOINT THE TIME AND SETTINGS ON A FAILING CELL
+//#define USE_HISTORY			// COMMENT OUT TO NOT LOG THE TEMPERATURE AND BATTERY HISTORY
+
+#define CS_BACKEND_CVD			// Touch sensing with the ADC (CVD charge sharing)
+//#define CS_BACKEND_CPS		// Touch sensing with the CPS oscillator counted by Timer0
+
+/*****************************************************************************
+* Cap sense backend comparison (same RB0/RB1 pads, 4 scans per second)
+*
+*                   CVD                         CPS
+* Active per pad    ~25us ADC conversion on     Oscillator and Timer0 run for
+*                   FRC at ~250uA               the whole 125ms tick, plus ~3
+*                                               Timer0 overflow interrupts
+* Current per scan  ~12nC, ~50nA average        several uA continuous, one pad
+*                                               is always being counted
+* Resolution        10 bit ADC, finger gives    ~800 counts per tick at 1:4,
+*                   ~30-80 counts               finger gives ~5-10% (40-80)
+* SNR (finger/pp)   ~15-25, one sample          ~40-60, counting averages over
+*                                               thousands of cycles
+*
+* These are estimates from the datasheet figures. Confirm them on the target
+* pads by watching raw[] and delta[] with the debugger. CVD stays the default
+* for battery life. CPS trades current for SNR. Proximity mode needs CVD.
+*****************************************************************************/
+#if defined(CS_BACKEND_CVD) == defined(CS_BACKEND_CPS)
+ #error "Select one of CS_BACKEND_CVD or CS_BACKEND_CPS"
+#endif
+#if defined(CS_BACKEND_CPS) && defined(USE_PROXIMITY)
+ #error "USE_PROXIMITY needs CS_BACKEND_CVD, the CPS oscillator is not a low power idle scan"
+#endif
 
 
 //*****************************************************************************
@@ -61,10 +105,255 @@
 #define ADC_BTN2        0b00101001              // select AN10 Button 2
 #define ADC_BTN1        0b00110001              // select AN12 Button 1
 
+#ifdef CS_BACKEND_CVD
 #define threshold       30                      // Power up default threshold for valid press
 #define thresholdmin	15						// Min threshold allowed
 #define thresholdmax	40						// Max threshold allowed
+#else
+#define threshold       40                      // CPS counts are ~800, finger is 5-10%
+#define thresholdmin	20
+#define thresholdmax	80
+#endif
 #define AVGRST_MAX		60*4					// If key held for more than 60 seconds reset it
+#define CS_PALM_SHIFT	3						// Delta over threshold<<3 (4 fingers) is a palm
+#define CS_REJECT_MAX	10*4					// Let baselines follow a rejection after 10 seconds
+#define CS_REFRESH_MIN	60						// Minutes between checks of the stored baseline
+
+//**** FVR session channels (FvrPending) ****
+#define FVR_BATTERY		0x01					// Battery on AN0
+#define FVR_TEMPERATURE	0x02					// Temperature sensor on AN9
+#define FVR_ALL			(FVR_BATTERY|FVR_TEMPERATURE)
+
+//**** Adaptive temperature sampling ****
+#define TEMP_PERIOD_MIN	80						// 1/4 seconds between samples while changing, 20s
+#define TEMP_STALE_MAX	300						// Longest time in seconds between samples when steady
+#define TEMP_PERIOD_MAX	(TEMP_STALE_MAX*4)		// in 1/4 seconds
+#define TEMP_DEADBAND	4						// mV (0.2C on MCP9701) change that resets the interval
+#if TEMP_PERIOD_MAX < TEMP_PERIOD_MIN || TEMP_STALE_MAX > 8000
+#error "TEMP_STALE_MAX must be 20 to 8000 seconds"
+#endif
+
+//**** Battery manager states (BatState) ****
+#define BAT_GOOD		0
+#define BAT_LOW			1						// Alert now and then
+#define BAT_CRITICAL	2						// Save power for the clock and the alarm
+#define BAT_ALERT_LOW	3600					// Seconds between alerts when low
+#define BAT_ALERT_CRIT	14400					// Seconds between alerts when critical
+#define BAT_CRIT_SCAN_DIV 4						// Cap sense every 4 ticks, one scan a second
+
+//**** Power manager states (PwrState) ****
+#define PWR_ACTIVE		0						// Being used - full key scan, display rotation
+#define PWR_IDLE		1						// Not touched for a while - half rate key scan
+#define PWR_STANDBY		2						// Not touched for long or at night - time only, proximity scan
+#define PWR_CRITICAL	3						// Critical battery - keep the clock and the alarm going
+#define PWR_DARK		4						// Display standby - LCD off, proximity scan
+#define PWR_STATES		5
+#define PWR_IDLE_S		10						// Seconds without a key to go Idle
+#define PWR_STANDBY_S	60						// Seconds without a key to go to Standby
+#define PWR_NIGHT_START	23						// From 23:00 to 06:00 go to Standby from Idle
+#define PWR_NIGHT_END	6
+#define PWR_DARK_S		600						// Seconds without a key to turn the display off
+#define PWR_DARK_START	1						// From 01:00 to 06:00 the display is off when not in use
+#define PWR_DARK_END	6
+
+#define PWR_F_PROX		0x01					// Proximity scan in place of the key scan
+#define PWR_F_TEMP		0x02					// Temperature sampling, by FvrTick from either scan
+#define PWR_F_ROTATE	0x04					// Display rotates through temperature and battery
+#define PWR_F_SOUND		0x08					// Key clicks and chimes, the alarm always sounds
+#define PWR_F_LCD		0x10					// Display on and redrawn
+
+//**** LCD ladder power and contrast from the battery and temperature ****
+#define LCD_COLD_MV		(T_OFFSET_ZERO + T_DIVISOR/2)	// Sensor mV at 5C, one step more drive below
+#define LCD_COLD_HYST	10						// mV above LCD_COLD_MV to leave the cold step
+#define LCD_DIAG_S		4						// Seconds the ladder settings show after a SET press
+#ifdef USE_BAT_GAUGE
+#define LCD_DIAG_PAGES	3						// Ladder, awake time and charge per main loop pass
+#else
+#define LCD_DIAG_PAGES	1
+#endif
+
+typedef struct {
+	unsigned char scan_div;						// Cap sense runs every scan_div ticks
+	unsigned char flags;						// PWR_F_xxx subsystems allowed to run
+	unsigned char lcd_rate;						// LCD_RATE_x frame rate with USE_LCD_ADAPT
+} PWR_POLICY;
+
+//**** Battery gauge - currents are battery side estimates, trim from a measured unit ****
+#define BAT_CAPACITY_MAH	500					// Usable AAAA alkaline capacity through the boost
+#define GAUGE_PERIOD		600					// Seconds per average current sample
+#define GAUGE_SLEEP_UA		12					// Sleep with LCD, T1OSC and the 8Hz cap sense interrupt
+#define GAUGE_AWAKE_UA		350					// Main loop running at 500KHz
+#define GAUGE_LF_UA			25					// Main loop running at 31KHz
+#define GAUGE_HF_UA			1400				// Main loop running at 4MHz
+#define GAUGE_FVR_UA		45					// FVR and temperature sensor on
+#define GAUGE_PWM_UA		1500				// Piezo driven
+#define GAUGE_ADC_UAS		8					// nA*s per FVR referenced conversion (~25us at 300uA)
+
+//**** Clock manager ****
+#define CLK_LOW			0						// LFINTOSC 31KHz
+#define CLK_MID			1						// 500KHz, cap sense, ADC and sound timing are set for this
+#define CLK_FAST		2						// HFINTOSC 4MHz
+#define CLK_SPEEDS		3
+#define CLK_STRATEGY	0						// 0 = 500KHz throughout, as measured on the board,
+												// 1 = 4MHz for the whole pass,
+												// 2 = 31KHz flag checks with 4MHz bursts for the work,
+												// measure with the SET diagnostic pages before using 1 or 2
+#if CLK_STRATEGY == 0
+ #define CLK_HOUSE		CLK_MID
+ #define CLK_BURST		CLK_MID
+#elif CLK_STRATEGY == 1
+ #define CLK_HOUSE		CLK_FAST
+ #define CLK_BURST		CLK_FAST
+#else
+ #define CLK_HOUSE		CLK_LOW
+ #define CLK_BURST		CLK_FAST
+#endif
+
+//**** Boot while T1OSC starts ****
+#define BOOT_VERSION_TICKS	8					// Longest the version shows while T1OSC starts, 1s
+
+//**** Battery internal resistance (needs USE_ALARM for the piezo load) ****
+#define BAT_LOAD_MA		15						// Battery current with the piezo driven, estimate
+#define BAT_RES_MIN_LEN	5						// First tone of 50ms or more for the loaded sample
+#if defined(USE_BAT_RES) && !defined(USE_ALARM)
+#undef USE_BAT_RES								// No piezo load to measure under
+#endif
+
+//**** Sound engine ****
+typedef struct
+{
+	unsigned char pr2;							// Tone period, 0 = rest
+	unsigned char duty;							// CCPR3L, sets the volume
+	unsigned char len;							// 10ms units for a tone, ticks for a rest, 0 = end
+} SOUND_STEP;
+
+//**** Alarms ****
+#define ALARM_COUNT		2						// Alarms, shown on F1 and F2
+#define ALARM_SNOOZED	0x80					// AlarmNextIdx flag, the next alarm is the snooze
+#define ALARM_SNOOZE_MIN 9						// SET while ringing snoozes for 9 minutes
+#define ALARM_SOFT_S	3						// Seconds of the quiet pattern before the loud one
+#define ALARM_SILENCE_S	120						// Ringing stops by itself after 2 minutes
+#define MINS_PER_DAY	1440
+#define SETUP_ALARM_LAST (4 + 3*ALARM_COUNT)	// Last Setup state, 3 per alarm from 5
+#ifndef USE_ALARM
+#define SoundPlay(p)							// No piezo without the alarm
+#endif
+
+//**** Time and settings kept in RAM over a warm reset ****
+#define PERSIST_SIG			0x5AC3				// Persist is valid
+#define PERSIST_LOST_TICKS	1					// The tick cut short by the reset, PWRT and Init
+
+typedef struct {
+	unsigned int sig;							// PERSIST_SIG, 0 while being written
+	unsigned char ticks;						// TickCount, written every tick, not in the sum
+	unsigned char hrs,min,sec;					// Checked by sum from here
+	char ampm,degcf;
+#ifdef USE_ALARM
+	unsigned char alarm_hrs[ALARM_COUNT],alarm_min[ALARM_COUNT],alarm_on;
+#endif
+	unsigned char sum;							// Two's complement of the byte sum
+} PERSIST;
+
+//**** Battery/temperature oversampling ****
+#ifdef USE_ADC_OVERSAMPLE
+#define ADC_OVS_N		2						// 4^2 = 16 conversions per reading, 2 extra bits
+#define ADC_FILTER_SHIFT 2						// Filter weight 1/4 per reading
+#else
+#define ADC_OVS_N		0						// One conversion as before
+#define ADC_FILTER_SHIFT 0						// No filter
+#endif
+#if ADC_OVS_N > 2
+#error "ADC_OVS_N above 2 overflows the sum"
+#endif
+
+//**** Data EEPROM map (256 bytes) ****
+#define EE_CS_BASE		0x00					// Cap sense calibration block
+#define EE_CS_SIZE		8						// magic, thold[2], base[2] LSB first, checksum
+#define EE_CS_MAGIC		0xC5					// Marks a written block
+#define EE_CKPT_BASE	0x10					// Low voltage checkpoint, 0x10 to 0x1F
+#define EE_SET_BASE		0x20					// Settings ring, 0x20 to 0x7F
+#define EE_SET_STRIDE	16						// Bytes per slot, room for more settings
+#define EE_SET_SLOTS	6						// Slots written in turn to spread the wear
+#define EE_LOG_BASE		0x80					// History log, 0x80 to 0xFF
+
+//**** Settings record, written to the next slot of the ring on Setup exit ****
+#define SET_VERSION		1						// Change when the record layout changes
+
+typedef struct {
+	unsigned char seq;							// Newest record has the highest, wraps
+	unsigned char ver;							// SET_VERSION
+	char ampm,degcf;
+	unsigned char alarm_hrs[ALARM_COUNT],alarm_min[ALARM_COUNT],alarm_on;
+	unsigned char crc;							// CRC-8 (0x07) of the bytes above
+} SETTINGS;
+
+//**** Low voltage checkpoint, the time and settings as the cell fails ****
+#define CKPT_MAGIC		0xC7					// Marks a checkpoint not yet used
+#define CKPT_LEVEL		(BAT_LEVEL_CRITICAL+100)	// mV, written on a reading below this
+#define CKPT_DROP		150						// or on a fall of this many mV between readings
+#if defined(USE_CHECKPOINT) && !defined(USE_SETTINGS_EE)
+#error "USE_CHECKPOINT needs USE_SETTINGS_EE"
+#endif
+
+typedef struct {
+	unsigned char magic;						// CKPT_MAGIC, 0 once used or the cell recovered
+	unsigned char hrs,min,sec;
+	SETTINGS set;								// seq of the ring record it was taken against
+	unsigned char crc;							// CRC-8 (0x07) of the bytes above
+} CKPT;
+
+//**** Temperature and battery history log ****
+// A block is a header with the first sample then one byte per sample, the
+// change in temperature (high nibble) and battery (low nibble), -8 to 7.
+// A larger change or a full block starts the next block. 27 samples per
+// block, 81 to 108 kept, 6 to 9 days at 2 hours. tools/logdump.c decodes it.
+#define LOG_INTERVAL_MIN	120					// Minutes between samples, 1 to 255
+#define LOG_BLOCK		32						// Bytes per block
+#define LOG_BLOCKS		4						// Blocks in the ring
+#define LOG_DATA		(LOG_BLOCK - sizeof(LOG_HEAD))	// Delta bytes per block
+#define LOG_SHIFT		3						// mV >> 3, 8mV (0.4C on the MCP9701) per count
+#define LOG_END			0x88					// Byte after the last delta of a block
+#define LOG_TREND_MIN	1440					// Trend over the last day
+#define HIST_PAGES		4						// Max, min and trend of the temperature, battery trend
+#define HIST_PAGE_S		4						// Seconds a page shows after a MODE press
+
+typedef struct {
+	unsigned char seq;							// Newest block has the highest, wraps
+	unsigned int stamp;							// Minute of the day of the first sample, 0 to 1439
+	unsigned char ivl;							// LOG_INTERVAL_MIN when written
+	unsigned char t0,b0;						// First sample, TemperatureV and BatteryV >> LOG_SHIFT
+} LOG_HEAD;
+
+typedef struct {
+	unsigned char blk;							// Block being read
+	unsigned char k;							// Blocks read so far
+	unsigned char i;							// Next delta in the block
+	unsigned char t,b;							// Sample, TemperatureV and BatteryV >> LOG_SHIFT
+} LOG_CUR;
+
+//**** Source of the interrupt driven EEPROM writes ****
+// The interrupt reads it until the write is done, so it is only filled
+// when EeLeft and WR are clear. Init uses it to read the blocks back.
+typedef union {
+	unsigned char cs[EE_CS_SIZE];				// Cap sense calibration block
+	SETTINGS set;								// Settings record
+	CKPT ckpt;									// Checkpoint
+	struct {
+		LOG_HEAD head;
+		unsigned char end;						// LOG_END
+	} log;										// New log block
+	unsigned char delta[2];						// Log delta and LOG_END after it
+} EE_BUF;
+
+//**** Cap sense temperature compensation ****
+#define TC_MIN_DT		4						// Learn only on a change of 4mV (0.2C) or more
+#define TC_DB_MAX		100						// Largest baseline move used for learning
+#define TC_LEARN_SHIFT	3						// Learning rate 1/8 per temperature sample
+#define TC_K_MAX		512						// Coefficient limit, 2 counts per mV (x256)
+
+//**** Proximity scan - both pads as one electrode while idle ****
+#define PROX_SCAN_TICKS		4					// Scan every 4 ticks (2Hz) instead of 4 pad scans/sec
+#define PROX_THRESHOLD		8					// Filtered drop that wakes the full key scan
 
 //**** cap touch defines for CVD ****
 #define BTN1_in         TRISB0  = 1             // make RB0 an input
@@ -78,6 +367,28 @@
 #define BTN2_high       LATB1   = 1             // set RB1 high
 
 
+//**** Touch input events ****
+// KeyScan() turns the BTN1/BTN2 levels into events once per scan. An event
+// code is the event type in the upper nibble OR'd with the keys involved.
+#define KEY_SET         0x01                    // BTN1 - Set button
+#define KEY_MODE        0x02                    // BTN2 - Mode button
+#define KEY_BOTH        0x03                    // Both buttons
+#define KEY_MASK        0x0F                    // Key bits of an event code
+
+#define KEY_EV_PRESS    0x10                    // Key(s) went down
+#define KEY_EV_RELEASE  0x20                    // Key(s) went up
+#define KEY_EV_LONG     0x30                    // Key(s) held for KEY_LONG_TICKS
+#define KEY_EV_REPEAT   0x40                    // Auto repeat while still held
+#define KEY_EV_MASK     0xF0                    // Type bits of an event code
+
+#define KEY_QUEUE_SIZE  4                       // Event queue depth, must be a power of 2
+#define KEY_CHORD_TICKS 2                       // A single press waits one scan for the other key
+#define KEY_LONG_TICKS  16                      // 2 seconds held is a long press
+#define KEY_FAST_TICKS  40                      // After 5 seconds held repeat goes fast
+#define KEY_REPEAT_SLOW 4                       // Slow repeat every 0.5 seconds
+#define KEY_REPEAT_FAST 2                       // Fast repeat every 0.25 seconds (every scan)
+
+
 
 //**** Set up default PORT and TRIS configurations for the pins ****
 #define LATA_LOAD       0b11111111
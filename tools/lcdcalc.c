@@ -0,0 +1,92 @@
+/*****************************************************************************
+*								lcdcalc.c
+*
+* Host side calculator for the LCD frame rate and ladder settings in lcd.h
+*
+* Prints the frame frequency of each LCD_RATE_x prescaler and the average
+* reference ladder current of each LCD_STEP_x at that rate. The ladder
+* currents per power mode are estimates at VDD 3V, trim them from a measured
+* unit.
+*
+* Build and run on the host:
+*		cc -o lcdcalc lcdcalc.c && ./lcdcalc
+*
+******************************************************************************/
+#include <stdio.h>
+
+#define _HARDWARE_H					// Only the LCD defines are needed
+#include "../src/lcd.h"
+
+#define T1OSC_HZ		32768.0
+#define LCD_MUX			4			// 1/4 multiplex, LMUX = 11 in LCDCON_LOAD
+
+static const double LadderUA[4]={0.0, 1.0, 10.0, 100.0};	// Off, low, medium, high
+
+static const unsigned char RateLp[LCD_RATES]={LCD_RATE_0_LP,LCD_RATE_1_LP,LCD_RATE_2_LP,LCD_RATE_3_LP};
+static const unsigned char StepRl[LCD_STEPS]={LCD_STEP_0_RL,LCD_STEP_1_RL,LCD_STEP_2_RL,LCD_STEP_3_RL};
+static const unsigned char StepCst[LCD_STEPS]={LCD_STEP_0_CST,LCD_STEP_1_CST,LCD_STEP_2_CST,LCD_STEP_3_CST};
+
+
+/******************************************************************************
+* Function: double FrameHz (unsigned char lp)
+*
+* Overview: Frame frequency for the LCDPS prescaler on T1OSC
+*
+* Input:    unsigned char lp  -  LCDPS LP<3:0>
+*
+* Output:   Frame frequency in Hz
+*
+******************************************************************************/
+static double FrameHz(unsigned char lp)
+{
+	return T1OSC_HZ / ((lp + 1) * 32.0 * LCD_MUX);
+}
+
+
+/******************************************************************************
+* Function: double LadderAvgUA (unsigned char rl, double frame)
+*
+* Overview: Average ladder current. Each of the 2 x LCD_MUX Type-A phases of
+*			a frame starts with LRLAT T1OSC clocks in the Type-A power mode,
+*			the rest of the phase is in the Type-B power mode.
+*
+* Input:    unsigned char rl  -  LCDRL value
+*
+*           double frame  -  frame frequency in Hz
+*
+* Output:   Current in uA
+*
+******************************************************************************/
+static double LadderAvgUA(unsigned char rl, double frame)
+{
+	double a;
+
+	a = frame * 2 * LCD_MUX * (rl & 0x07) / T1OSC_HZ;	// Time in Type-A
+	if(a > 1.0) a = 1.0;
+	return a * LadderUA[(rl >> 6) & 3] + (1.0 - a) * LadderUA[(rl >> 4) & 3];
+}
+
+
+int main(void)
+{
+	unsigned char r, s;
+	double frame;
+
+	printf("LCDPS_LOAD %02X gives %.1fHz\n\n", LCDPS_LOAD, FrameHz(LCDPS_LOAD & 0x0F));
+
+	printf("Rate  LP  Frame Hz ");
+	for(s = 0; s < LCD_STEPS; s++) printf("  Step%u uA", s);
+	printf("\n");
+
+	for(r = 0; r < LCD_RATES; r++)
+	{
+		frame = FrameHz(RateLp[r]);
+		printf("%4u %3u %9.1f ", r, RateLp[r], frame);
+		for(s = 0; s < LCD_STEPS; s++) printf(" %9.2f", LadderAvgUA(StepRl[s], frame));
+		printf("%s\n", r == LCD_RATE_COLD ? "   cold" : "");
+	}
+
+	printf("\nStep  LCDRL  LCDCST\n");
+	for(s = 0; s < LCD_STEPS; s++) printf("%4u   %02X     %u\n", s, StepRl[s], StepCst[s]);
+	return 0;
+}
@@ -0,0 +1,178 @@
+/*****************************************************************************
+*								logdump.c
+*
+* Host side decoder for the temperature and battery history log (USE_HISTORY)
+*
+* Read the data EEPROM out with the programmer (MPLAB IPE: Read, then
+* File > Export > Hex, or the EEPROM of a read in MPLAB X) and feed the
+* Intel HEX file in. The data EEPROM is at word 0xF000, one byte per word.
+* Prints every sample from the oldest with the day and time of day, the
+* sensor and battery mV and the temperature, then the range.
+*
+* The clock has no date, so the day counts from the first block and a gap
+* of more than a day with the power off is not seen.
+*
+* The log format below must match main.h.
+*
+* Build and run on the host:
+*		cc -o logdump logdump.c && ./logdump < eeprom.hex
+*
+******************************************************************************/
+#include <stdio.h>
+#include <string.h>
+
+#define EE_HEX_ADDR		0x1E000		// Byte address of word 0xF000 in the hex file
+#define EE_SIZE			256
+
+#define EE_LOG_BASE		0x80		// As main.h
+#define LOG_BLOCK		32
+#define LOG_BLOCKS		4
+#define LOG_HEAD_SIZE	6			// seq, stamp LSB first, ivl, t0, b0
+#define LOG_DATA		(LOG_BLOCK - LOG_HEAD_SIZE)
+#define LOG_SHIFT		3
+#define LOG_END			0x88
+#define MINS_PER_DAY	1440
+
+#define T_OFFSET_ZERO	400			// MCP9701, as hardware.h
+#define T_MV_PER_C		19.5
+
+static unsigned char Ee[EE_SIZE];
+
+
+/******************************************************************************
+* Function: int HexByte (const char *s)
+*
+* Overview: Two hex digits to a byte
+*
+* Input:    s - the digits
+*
+* Output:   0 to 255, -1 if not hex
+*
+******************************************************************************/
+static int HexByte(const char *s)
+{
+	unsigned int v;
+
+	if(sscanf(s, "%2x", &v) != 1) return -1;
+	return v;
+}
+
+
+/******************************************************************************
+* Function: int ReadHex (FILE *f)
+*
+* Overview: Reads an Intel HEX file into Ee[], the even bytes of the data
+*			EEPROM words. Bytes not in the file stay 0xFF, as erased.
+*
+* Input:    FILE *f  -  the hex file
+*
+* Output:   Number of EEPROM bytes found
+*
+******************************************************************************/
+static int ReadHex(FILE *f)
+{
+	char line[600];
+	unsigned long base = 0, addr;
+	int len, type, i, found = 0;
+
+	memset(Ee, 0xFF, sizeof(Ee));
+	while(fgets(line, sizeof(line), f))
+	{
+		if(line[0] != ':') continue;
+		len = HexByte(line + 1);
+		addr = (HexByte(line + 3) << 8) | HexByte(line + 5);
+		type = HexByte(line + 7);
+		if(len < 0 || type < 0 || strlen(line) < 11 + 2 * (size_t)len) continue;
+
+		if(type == 4) base = (unsigned long)((HexByte(line + 9) << 8) | HexByte(line + 11)) << 16;
+		if(type != 0) continue;
+		for(i = 0; i < len; i++)
+		{
+			unsigned long a = base + addr + i - EE_HEX_ADDR;
+			if(a >= 2 * EE_SIZE || (a & 1)) continue;
+			Ee[a >> 1] = HexByte(line + 9 + 2 * i);
+			found++;
+		}
+	}
+	return found;
+}
+
+
+/******************************************************************************
+* Function: double TempC (unsigned int mv)
+*
+* Overview: Sensor mV to degrees C
+*
+* Input:    unsigned int mv  -  sensor mV
+*
+* Output:   Temperature in C
+*
+******************************************************************************/
+static double TempC(unsigned int mv)
+{
+	return ((double)mv - T_OFFSET_ZERO) / T_MV_PER_C;
+}
+
+
+int main(void)
+{
+	const unsigned char *h, *newest = 0;
+	unsigned int stamp, t, b, tmin = 0xFFFF, tmax = 0, n = 0;
+	unsigned long start, when, last = 0;
+	int blk, k, i;
+	unsigned char d;
+
+	if(ReadHex(stdin) == 0)
+	{
+		fprintf(stderr, "No data EEPROM in the hex file\n");
+		return 1;
+	}
+
+	// The newest block has the highest sequence number, the oldest follows it
+	for(blk = 0; blk < LOG_BLOCKS; blk++)
+	{
+		h = Ee + EE_LOG_BASE + blk * LOG_BLOCK;
+		if((h[1] | h[2] << 8) >= MINS_PER_DAY || h[3] == 0) continue;
+		if(newest && (signed char)(h[0] - newest[0]) <= 0) continue;
+		newest = h;
+	}
+	if(newest == 0)
+	{
+		printf("Log is empty\n");
+		return 0;
+	}
+
+	printf(" Day  Time  Sensor mV   Temp C  Battery mV\n");
+	blk = (newest - Ee - EE_LOG_BASE) / LOG_BLOCK;
+	for(k = 0; k < LOG_BLOCKS; k++)
+	{
+		if(++blk >= LOG_BLOCKS) blk = 0;
+		h = Ee + EE_LOG_BASE + blk * LOG_BLOCK;
+		stamp = h[1] | h[2] << 8;
+		if(stamp >= MINS_PER_DAY || h[3] == 0) continue;
+
+		start = (last / MINS_PER_DAY) * MINS_PER_DAY + stamp;
+		if(n && start < last) start += MINS_PER_DAY;	// Went past midnight
+		t = h[4];
+		b = h[5];
+		for(i = 0; ; i++)
+		{
+			when = start + (unsigned long)i * h[3];
+			printf("%4lu %02lu:%02lu %10u %8.1f %11u\n", when / MINS_PER_DAY,
+				(when % MINS_PER_DAY) / 60, when % 60,
+				t << LOG_SHIFT, TempC(t << LOG_SHIFT), b << LOG_SHIFT);
+			if(t < tmin) tmin = t;
+			if(t > tmax) tmax = t;
+			last = when;
+			n++;
+			if(i >= LOG_DATA) break;
+			d = h[LOG_HEAD_SIZE + i];
+			if(d == LOG_END) break;
+			t = (t + ((d >> 4) ^ 8) - 8) & 0xFF;
+			b = (b + ((d & 0x0F) ^ 8) - 8) & 0xFF;
+		}
+	}
+
+	printf("\n%u samples, %.1fC to %.1fC\n", n, TempC(tmin << LOG_SHIFT), TempC(tmax << LOG_SHIFT));
+	return 0;
+}